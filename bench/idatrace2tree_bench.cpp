@@ -0,0 +1,279 @@
+#include "CmdOpts.h"
+#include "IdaCallStackBuilder.h"
+#include "IdaTraceFileRecord.h"
+#include "IdaTraceGenerator.h"
+#include "IdaTraceRecordView.h"
+#include "OutputBuffer.h"
+#include "TraceCallTree.h"
+#include "TraceTokenReader.h"
+#include "TraceTokenizer.h"
+#include "IdaTreePrinters.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+struct BenchOpts
+{
+  std::string sInputFile{};
+  std::string sGenerateFile{};
+  int iRecords{ 1000000 };
+  int iMaxDepth{ 16 };
+  int iThreads{ 1 };
+  int iNameLength{ 16 };
+  int iFunctions{ 64 };
+  double fCallRatio{ 0.15 };
+  double fReturnRatio{ 0.13 };
+  double fBndRatio{ 0.1 };
+  double fSkipRatio{ 0.01 };
+  int iSeed{ 1 };
+  int iRepeat{ 3 };
+};
+
+// Stream buffer that only counts what the printers write
+class CountingStreamBuf : public std::streambuf
+{
+public:
+  size_t size() const { return miSize; }
+
+protected:
+  std::streamsize xsputn(const char*, std::streamsize iCount) override
+  {
+    miSize += static_cast<size_t>(iCount);
+    return iCount;
+  }
+
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      ++miSize;
+    }
+    return traits_type::not_eof(c);
+  }
+
+private:
+  size_t miSize = 0;
+};
+
+// Best of the repeated runs of a stage
+struct StageResult
+{
+  const char* sName = "";
+  double fSeconds = 0;
+  size_t iRecords = 0;
+  size_t iBytes = 0;
+};
+
+template<class TStage>
+StageResult runStage(const char* sName, int iRepeat, TStage stage)
+{
+  StageResult result;
+  result.sName = sName;
+  for (int i = 0; i < std::max(1, iRepeat); ++i)
+  {
+    size_t iRecords = 0;
+    size_t iBytes = 0;
+    const auto start = std::chrono::steady_clock::now();
+    stage(iRecords, iBytes);
+    const double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (i == 0 || fSeconds < result.fSeconds)
+    {
+      result.fSeconds = fSeconds;
+      result.iRecords = iRecords;
+      result.iBytes = iBytes;
+    }
+  }
+  return result;
+}
+
+void printResult(const StageResult& result)
+{
+  const double fSeconds = result.fSeconds > 0 ? result.fSeconds : 1e-9;
+  std::printf("%-24s %10.3f s %14.0f records/s %10.1f MB/s\n", result.sName, result.fSeconds,
+    result.iRecords / fSeconds, result.iBytes / fSeconds / (1 << 20));
+}
+
+int main(int argc, const char* argv[])
+{
+  auto parser = CmdOpts<BenchOpts>::Create({
+      {"--input", &BenchOpts::sInputFile },
+      {"--generate", &BenchOpts::sGenerateFile },
+      {"--records", &BenchOpts::iRecords },
+      {"--depth", &BenchOpts::iMaxDepth },
+      {"--threads", &BenchOpts::iThreads },
+      {"--name-length", &BenchOpts::iNameLength },
+      {"--functions", &BenchOpts::iFunctions },
+      {"--call-ratio", &BenchOpts::fCallRatio },
+      {"--return-ratio", &BenchOpts::fReturnRatio },
+      {"--bnd-ratio", &BenchOpts::fBndRatio },
+      {"--skip-ratio", &BenchOpts::fSkipRatio },
+      {"--seed", &BenchOpts::iSeed },
+      {"--repeat", &BenchOpts::iRepeat },
+    });
+
+  const auto options = parser->parse(argc, argv);
+
+  IdaTraceGeneratorOptions generatorOptions;
+  generatorOptions.iRecords = static_cast<uint64_t>(std::max(0, options.iRecords));
+  generatorOptions.iMaxDepth = options.iMaxDepth;
+  generatorOptions.iThreads = options.iThreads;
+  generatorOptions.iNameLength = options.iNameLength;
+  generatorOptions.iFunctions = options.iFunctions;
+  generatorOptions.fCallRatio = options.fCallRatio;
+  generatorOptions.fReturnRatio = options.fReturnRatio;
+  generatorOptions.fBndRatio = options.fBndRatio;
+  generatorOptions.fSkipRatio = options.fSkipRatio;
+  generatorOptions.iSeed = static_cast<uint64_t>(options.iSeed);
+
+  // Only write a trace for later runs of idatrace2tree
+  if (!options.sGenerateFile.empty())
+  {
+    std::ofstream output(options.sGenerateFile, std::ios::binary);
+    IdaTraceGenerator generator(generatorOptions);
+    std::string sBlock;
+    generator.appendHeader(sBlock);
+    while (generator.appendRecord(sBlock))
+    {
+      if (sBlock.size() >= (1 << 20))
+      {
+        output.write(sBlock.data(), sBlock.size());
+        sBlock.clear();
+      }
+    }
+    output.write(sBlock.data(), sBlock.size());
+    return output ? 0 : 1;
+  }
+
+  std::string sTrace;
+  if (options.sInputFile.empty())
+  {
+    IdaTraceGenerator generator(generatorOptions);
+    generator.generate(sTrace);
+  }
+  else
+  {
+    std::ifstream input(options.sInputFile, std::ios::binary);
+    std::stringstream content;
+    content << input.rdbuf();
+    sTrace = content.str();
+  }
+
+  std::vector<std::array<std::string_view, 4>> rows;
+  std::vector<IdaTraceRecordView> records;
+  CallTree<IdaTraceRecordView> tree;
+  IdaTraceFilters filters;
+  filters.build();
+
+  std::printf("trace = %zu bytes\n\n", sTrace.size());
+
+  // Rows cut into cells
+  printResult(runStage("parse", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    rows.clear();
+    std::string_view sInput = sTrace;
+    std::array<std::string_view, 4> cells;
+    while (IdaTraceRecordView::readCells(sInput, cells))
+    {
+      rows.push_back(cells);
+    }
+    iRecords = rows.size();
+    iBytes = sTrace.size();
+  }));
+
+  // Cells split into fields and names interned
+  printResult(runStage("field split", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    records.clear();
+    for (const auto& cells : rows)
+    {
+      records.emplace_back(cells[0], cells[1], cells[2], cells[3]);
+    }
+    iRecords = records.size();
+    iBytes = sTrace.size();
+  }));
+
+  // Separators of the whole trace found in one pass
+  TraceTokens tokens;
+  const std::string sTokenizeStage = std::string("tokenize (") + traceTokenizerPath() + ")";
+  printResult(runStage(sTokenizeStage.c_str(), options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    tokenizeTrace(sTrace, tokens);
+    iRecords = rows.size();
+    iBytes = sTrace.size();
+  }));
+
+  // Rows split at the separators of tokenized blocks, the mapped input path
+  printResult(runStage("parse + split (tokens)", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    TraceTokenReader reader(sTrace);
+    IdaTraceRecordView record;
+    while (reader.readLine(record))
+    {
+      ++iRecords;
+    }
+    iBytes = sTrace.size();
+  }));
+
+  // Both at once from a stream into owning records, the default input path
+  printResult(runStage("parse + split (istream)", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    std::istringstream input(sTrace);
+    IdaTraceFileRecord record;
+    while (IdaTraceFileRecord::readLine(input, record))
+    {
+      ++iRecords;
+    }
+    iBytes = sTrace.size();
+  }));
+
+  printResult(runStage("tree build", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    IdaCallStackBuilder<IdaTraceRecordView> builder;
+    CallTreeAppender<IdaTraceRecordView> appender(tree);
+    for (const auto& record : records)
+    {
+      IdaTraceRecordView copy = record;
+      builder.append(copy, appender);
+    }
+    iRecords = records.size();
+    iBytes = sTrace.size();
+  }));
+
+  printResult(runStage("text print", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    CountingStreamBuf counter;
+    OutputBuffer output(&counter);
+    IdaTreeTabbedPrinterContext context;
+    context.pOutput = &output;
+    context.pFilters = &filters;
+    tree.traverse(&treeTabbedTextPrinter<IdaTraceRecordView>, 0, &context);
+    output.flush();
+    iRecords = tree.size();
+    iBytes = counter.size();
+  }));
+
+  printResult(runStage("dot print", options.iRepeat, [&](size_t& iRecords, size_t& iBytes)
+  {
+    CountingStreamBuf counter;
+    OutputBuffer output(&counter);
+    IdaTreeDotPrinterContext<IdaTraceRecordView> context;
+    context.pOutput = &output;
+    context.pFilters = &filters;
+    treeDotTextPrinterHeader<IdaTraceRecordView>(&context);
+    tree.traverse(&treeDotTextPrinter<IdaTraceRecordView>, context.iDepthPrev, &context);
+    treeDotTextPrinterFooter<IdaTraceRecordView>(&context);
+    output.flush();
+    iRecords = tree.size();
+    iBytes = counter.size();
+  }));
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Stream buffer that writes a file on its own thread. The printer fills
+// large blocks and hands them over to the writer, so formatting does not
+// wait for the disk. Flushing the stream does not force a write; the data
+// reaches the file when a block is full and on close().
+class AsyncFileWriter : public std::streambuf
+{
+public:
+  explicit AsyncFileWriter(const std::string& sPath, size_t iBlockSize = 1 << 20, size_t iMaxQueued = 8)
+    : miBlockSize(iBlockSize)
+    , miMaxQueued(iMaxQueued)
+  {
+    mpFile = std::fopen(sPath.c_str(), "w");
+    if (mpFile == nullptr)
+    {
+      return;
+    }
+
+    mBlock.resize(miBlockSize);
+    setp(mBlock.data(), mBlock.data() + mBlock.size());
+    mWriter = std::thread(&AsyncFileWriter::run, this);
+  }
+
+  ~AsyncFileWriter()
+  {
+    close();
+  }
+
+  AsyncFileWriter(const AsyncFileWriter&) = delete;
+  AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+  bool isOpen() const { return mpFile != nullptr; }
+
+  // Writes the pending blocks and closes the file
+  void close()
+  {
+    if (mpFile == nullptr)
+    {
+      return;
+    }
+
+    submit();
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mbClosing = true;
+    }
+    mWakeup.notify_all();
+    mWriter.join();
+
+    std::fclose(mpFile);
+    mpFile = nullptr;
+    setp(nullptr, nullptr);
+  }
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (mpFile == nullptr)
+    {
+      return traits_type::eof();
+    }
+
+    submit();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override
+  {
+    return 0;
+  }
+
+private:
+  // Queues the filled part of the current block and starts a new one
+  void submit()
+  {
+    const size_t iUsed = static_cast<size_t>(pptr() - pbase());
+    if (iUsed == 0)
+    {
+      return;
+    }
+    mBlock.resize(iUsed);
+
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mSpace.wait(lock, [this] { return mQueue.size() < miMaxQueued; });
+      mQueue.push_back(std::move(mBlock));
+      if (!mFree.empty())
+      {
+        mBlock = std::move(mFree.back());
+        mFree.pop_back();
+      }
+    }
+    mWakeup.notify_one();
+
+    mBlock.resize(miBlockSize);
+    setp(mBlock.data(), mBlock.data() + mBlock.size());
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (;;)
+    {
+      mWakeup.wait(lock, [this] { return mbClosing || !mQueue.empty(); });
+      if (mQueue.empty())
+      {
+        return;
+      }
+
+      std::vector<char> block = std::move(mQueue.front());
+      mQueue.pop_front();
+      mSpace.notify_one();
+
+      lock.unlock();
+      std::fwrite(block.data(), 1, block.size(), mpFile);
+      lock.lock();
+
+      mFree.push_back(std::move(block));
+    }
+  }
+
+  std::FILE* mpFile = nullptr;
+  const size_t miBlockSize;
+  const size_t miMaxQueued;
+  std::vector<char> mBlock;
+
+  std::mutex mMutex;
+  std::condition_variable mWakeup;
+  std::condition_variable mSpace;
+  std::deque<std::vector<char>> mQueue;
+  std::vector<std::vector<char>> mFree;
+  bool mbClosing = false;
+  std::thread mWriter;
+};
+
+// Output stream over its own AsyncFileWriter, used like std::ofstream
+class AsyncFileStream : public std::ostream
+{
+public:
+  explicit AsyncFileStream(const std::string& sPath)
+    : std::ostream(nullptr)
+    , mWriter(sPath)
+  {
+    rdbuf(&mWriter);
+    if (!mWriter.isOpen())
+    {
+      setstate(std::ios_base::failbit);
+    }
+  }
+
+  void close()
+  {
+    mWriter.close();
+  }
+
+private:
+  AsyncFileWriter mWriter;
+};
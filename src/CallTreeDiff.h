@@ -0,0 +1,365 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "CallTreeSharing.h"
+#include "TraceCallTree.h"
+
+// Hash and node count of every subtree, by node id
+struct CallTreeHashes
+{
+  std::vector<uint64_t> hashes;
+  std::vector<uint64_t> sizes;
+};
+
+// Children have higher ids than their parent, so one pass from the last node
+// back finds every subtree complete. The hashes are those of
+// CallTreeSharingAppender.
+template<class T>
+CallTreeHashes hashCallTree(CallTree<T>& tree)
+{
+  CallTreeHashes result;
+  result.hashes.resize(tree.size());
+  result.sizes.resize(tree.size());
+  for (size_t i = tree.size(); i-- > 0;)
+  {
+    CallTreeNode<T>& node = tree.node(static_cast<CallTreeNodeId>(i));
+    uint64_t iHash = callTreeRecordHash(node.value);
+    uint64_t iNodes = 1;
+    if (node.iFirstChild != kNoCallTreeNode)
+    {
+      uint64_t iChildrenHash = 0;
+      for (CallTreeNodeId iChild = node.iFirstChild; iChild != kNoCallTreeNode; iChild = tree.node(iChild).iNextSibling)
+      {
+        iChildrenHash = combineCallTreeHash(iChildrenHash, result.hashes[iChild]);
+        iNodes += result.sizes[iChild];
+      }
+      iHash = combineCallTreeHash(iHash, iChildrenHash);
+    }
+    result.hashes[i] = iHash;
+    result.sizes[i] = iNodes;
+  }
+  return result;
+}
+
+enum class CallTreeDiffKind : uint8_t
+{
+  // In both trees, with a difference below
+  Common,
+  // Only in the first tree, with its subtree
+  Removed,
+  // Only in the second tree, with its subtree
+  Added,
+};
+
+struct CallTreeDiffStats
+{
+  uint64_t iCommon = 0;
+  // Removed and added nodes with their subtrees: a changed instruction is
+  // one subtree of one node
+  uint64_t iRemovedSubtrees = 0;
+  uint64_t iAddedSubtrees = 0;
+  uint64_t iRemovedNodes = 0;
+  uint64_t iAddedNodes = 0;
+  // Nodes of the first tree in subtrees equal in both, never looked at
+  uint64_t iSameNodes = 0;
+};
+
+// Compares two call trees top-down. Subtrees with equal hashes, node counts
+// and top records are skipped at once, so the work grows with the
+// differences, not with the trees. The nodes below are not compared: two
+// different subtrees are only taken as equal if their 64-bit hashes collide
+// while their sizes and top records match.
+// The children of two common calls are aligned by a Myers diff of their
+// hashes; a removed and an added call with the same record are compared
+// further down instead.
+template<class T>
+class CallTreeDiff
+{
+public:
+  // Edits found between two child lists before they are aligned by position
+  static constexpr size_t kMaxEdits = 1000;
+  // Added calls looked at for a removed one with the same record
+  static constexpr size_t kPairWindow = 64;
+
+  CallTreeDiff(CallTree<T>& first, CallTree<T>& second)
+    : mFirst(first)
+    , mSecond(second)
+    , mFirstHashes(hashCallTree(first))
+    , mSecondHashes(hashCallTree(second))
+  {
+  }
+
+  // Hands the differences to sink(kind, node, iDepth, iNodes) in pre-order:
+  // every difference comes after the common calls leading to it. Common and
+  // removed nodes are those of the first tree, added ones of the second;
+  // iNodes counts the subtree of a removed or added node.
+  template<class TSink>
+  CallTreeDiffStats run(TSink& sink)
+  {
+    CallTreeDiffStats stats;
+    if (isSameSubtree(0, 0))
+    {
+      stats.iSameNodes = mFirstHashes.sizes[0];
+      return stats;
+    }
+
+    // Explicit stack, call trees can be deeper than the native one
+    std::vector<Task> tasks{ { CallTreeDiffKind::Common, 0, 0, 0 } };
+    while (!tasks.empty())
+    {
+      const Task task = tasks.back();
+      tasks.pop_back();
+      switch (task.kind)
+      {
+      case CallTreeDiffKind::Common:
+        if (task.iDepth > 0)
+        {
+          sink(CallTreeDiffKind::Common, mFirst.node(task.iFirst), task.iDepth, uint64_t(1));
+          ++stats.iCommon;
+        }
+        compareChildren(task, stats);
+        tasks.insert(tasks.end(), mTasks.rbegin(), mTasks.rend());
+        break;
+      case CallTreeDiffKind::Removed:
+        sink(CallTreeDiffKind::Removed, mFirst.node(task.iFirst), task.iDepth, mFirstHashes.sizes[task.iFirst]);
+        ++stats.iRemovedSubtrees;
+        stats.iRemovedNodes += mFirstHashes.sizes[task.iFirst];
+        break;
+      case CallTreeDiffKind::Added:
+        sink(CallTreeDiffKind::Added, mSecond.node(task.iSecond), task.iDepth, mSecondHashes.sizes[task.iSecond]);
+        ++stats.iAddedSubtrees;
+        stats.iAddedNodes += mSecondHashes.sizes[task.iSecond];
+        break;
+      }
+    }
+    return stats;
+  }
+
+private:
+  struct Task
+  {
+    CallTreeDiffKind kind;
+    CallTreeNodeId iFirst;
+    CallTreeNodeId iSecond;
+    int iDepth;
+  };
+
+  // An edit turning the first child list into the second one
+  struct Edit
+  {
+    CallTreeDiffKind kind;
+    size_t iFirst;
+    size_t iSecond;
+  };
+
+  // Fills mTasks with the differences between the children of a common call
+  void compareChildren(const Task& parent, CallTreeDiffStats& stats)
+  {
+    mTasks.clear();
+    children(mFirst, parent.iFirst, mFirstChildren);
+    children(mSecond, parent.iSecond, mSecondChildren);
+
+    // Equal heads and tails need no alignment
+    size_t iBegin = 0;
+    size_t iFirstEnd = mFirstChildren.size();
+    size_t iSecondEnd = mSecondChildren.size();
+    while (iBegin < iFirstEnd && iBegin < iSecondEnd && isSame(iBegin, iBegin))
+    {
+      stats.iSameNodes += mFirstHashes.sizes[mFirstChildren[iBegin++]];
+    }
+    while (iFirstEnd > iBegin && iSecondEnd > iBegin && isSame(iFirstEnd - 1, iSecondEnd - 1))
+    {
+      stats.iSameNodes += mFirstHashes.sizes[mFirstChildren[--iFirstEnd]];
+      --iSecondEnd;
+    }
+
+    align(iBegin, iFirstEnd, iBegin, iSecondEnd);
+
+    // A removed and an added call with the same record differ further down
+    const int iDepth = parent.iDepth + 1;
+    for (size_t i = 0; i < mEdits.size();)
+    {
+      if (mEdits[i].kind == CallTreeDiffKind::Common)
+      {
+        stats.iSameNodes += mFirstHashes.sizes[mFirstChildren[mEdits[i].iFirst]];
+        ++i;
+        continue;
+      }
+
+      mRemoved.clear();
+      mAdded.clear();
+      for (; i < mEdits.size() && mEdits[i].kind != CallTreeDiffKind::Common; ++i)
+      {
+        if (mEdits[i].kind == CallTreeDiffKind::Removed)
+        {
+          mRemoved.push_back(mFirstChildren[mEdits[i].iFirst]);
+        }
+        else
+        {
+          mAdded.push_back(mSecondChildren[mEdits[i].iSecond]);
+        }
+      }
+
+      size_t iNextAdded = 0;
+      for (const CallTreeNodeId iRemoved : mRemoved)
+      {
+        const size_t iWindowEnd = std::min(mAdded.size(), iNextAdded + kPairWindow);
+        size_t iPair = iNextAdded;
+        while (iPair < iWindowEnd && !isSameCallTreeRecord(mFirst.node(iRemoved).value, mSecond.node(mAdded[iPair]).value))
+        {
+          ++iPair;
+        }
+        if (iPair == iWindowEnd)
+        {
+          mTasks.push_back({ CallTreeDiffKind::Removed, iRemoved, kNoCallTreeNode, iDepth });
+          continue;
+        }
+        for (; iNextAdded < iPair; ++iNextAdded)
+        {
+          mTasks.push_back({ CallTreeDiffKind::Added, kNoCallTreeNode, mAdded[iNextAdded], iDepth });
+        }
+        mTasks.push_back({ CallTreeDiffKind::Common, iRemoved, mAdded[iPair], iDepth });
+        ++iNextAdded;
+      }
+      for (; iNextAdded < mAdded.size(); ++iNextAdded)
+      {
+        mTasks.push_back({ CallTreeDiffKind::Added, kNoCallTreeNode, mAdded[iNextAdded], iDepth });
+      }
+    }
+  }
+
+  // Myers' O(ND) diff of the hashes of mFirstChildren[iFirstBegin, iFirstEnd)
+  // and mSecondChildren[iSecondBegin, iSecondEnd) into mEdits. Lists with
+  // more than kMaxEdits differences are removed and added as a whole, the
+  // pairing by record still finds the calls they have in common.
+  void align(size_t iFirstBegin, size_t iFirstEnd, size_t iSecondBegin, size_t iSecondEnd)
+  {
+    mEdits.clear();
+    const int iN = static_cast<int>(iFirstEnd - iFirstBegin);
+    const int iM = static_cast<int>(iSecondEnd - iSecondBegin);
+    const int iMaxD = static_cast<int>(std::min<size_t>(static_cast<size_t>(iN) + static_cast<size_t>(iM), kMaxEdits));
+
+    // mFrontier[iOffset + k] is the furthest x on diagonal k = x - y
+    const int iOffset = iMaxD + 1;
+    mFrontier.assign(static_cast<size_t>(2 * iMaxD + 3), 0);
+    mHistory.clear();
+    int iFoundD = -1;
+    for (int d = 0; d <= iMaxD && iFoundD < 0; ++d)
+    {
+      for (int k = -d; k <= d; k += 2)
+      {
+        int x;
+        if (k == -d || (k != d && mFrontier[iOffset + k - 1] < mFrontier[iOffset + k + 1]))
+        {
+          x = mFrontier[iOffset + k + 1];
+        }
+        else
+        {
+          x = mFrontier[iOffset + k - 1] + 1;
+        }
+        int y = x - k;
+        while (x < iN && y < iM && isSame(iFirstBegin + x, iSecondBegin + y))
+        {
+          ++x;
+          ++y;
+        }
+        mFrontier[iOffset + k] = x;
+        if (x >= iN && y >= iM)
+        {
+          iFoundD = d;
+          break;
+        }
+      }
+      // Diagonals -d..d of this round, the way back needs them
+      mHistory.insert(mHistory.end(), mFrontier.begin() + (iOffset - d), mFrontier.begin() + (iOffset + d + 1));
+    }
+
+    if (iFoundD < 0)
+    {
+      for (size_t i = iFirstBegin; i < iFirstEnd; ++i)
+      {
+        mEdits.push_back({ CallTreeDiffKind::Removed, i, 0 });
+      }
+      for (size_t i = iSecondBegin; i < iSecondEnd; ++i)
+      {
+        mEdits.push_back({ CallTreeDiffKind::Added, 0, i });
+      }
+      return;
+    }
+
+    // Round d starts at d * d in mHistory
+    int x = iN;
+    int y = iM;
+    for (int d = iFoundD; d > 0; --d)
+    {
+      const int* pPrev = mHistory.data() + static_cast<size_t>(d - 1) * static_cast<size_t>(d - 1) + (d - 1);
+      const int k = x - y;
+      const int iPrevK = (k == -d || (k != d && pPrev[k - 1] < pPrev[k + 1])) ? k + 1 : k - 1;
+      const int iPrevX = pPrev[iPrevK];
+      const int iPrevY = iPrevX - iPrevK;
+      while (x > iPrevX && y > iPrevY)
+      {
+        --x;
+        --y;
+        mEdits.push_back({ CallTreeDiffKind::Common, iFirstBegin + x, iSecondBegin + y });
+      }
+      if (iPrevK == k + 1)
+      {
+        mEdits.push_back({ CallTreeDiffKind::Added, 0, iSecondBegin + iPrevY });
+      }
+      else
+      {
+        mEdits.push_back({ CallTreeDiffKind::Removed, iFirstBegin + iPrevX, 0 });
+      }
+      x = iPrevX;
+      y = iPrevY;
+    }
+    while (x > 0 && y > 0)
+    {
+      --x;
+      --y;
+      mEdits.push_back({ CallTreeDiffKind::Common, iFirstBegin + x, iSecondBegin + y });
+    }
+    std::reverse(mEdits.begin(), mEdits.end());
+  }
+
+  bool isSame(size_t iFirst, size_t iSecond) const
+  {
+    return isSameSubtree(mFirstChildren[iFirst], mSecondChildren[iSecond]);
+  }
+
+  // The hash decides, the size and the record rule out most collisions
+  bool isSameSubtree(CallTreeNodeId iFirst, CallTreeNodeId iSecond) const
+  {
+    return mFirstHashes.hashes[iFirst] == mSecondHashes.hashes[iSecond]
+      && mFirstHashes.sizes[iFirst] == mSecondHashes.sizes[iSecond]
+      && isSameCallTreeRecord(mFirst.node(iFirst).value, mSecond.node(iSecond).value);
+  }
+
+  static void children(CallTree<T>& tree, CallTreeNodeId iParent, std::vector<CallTreeNodeId>& result)
+  {
+    result.clear();
+    for (CallTreeNodeId iChild = tree.node(iParent).iFirstChild; iChild != kNoCallTreeNode; iChild = tree.node(iChild).iNextSibling)
+    {
+      result.push_back(iChild);
+    }
+  }
+
+  CallTree<T>& mFirst;
+  CallTree<T>& mSecond;
+  const CallTreeHashes mFirstHashes;
+  const CallTreeHashes mSecondHashes;
+
+  // Scratch space of compareChildren, reused for every common call
+  std::vector<CallTreeNodeId> mFirstChildren;
+  std::vector<CallTreeNodeId> mSecondChildren;
+  std::vector<CallTreeNodeId> mRemoved;
+  std::vector<CallTreeNodeId> mAdded;
+  std::vector<Edit> mEdits;
+  std::vector<int> mFrontier;
+  std::vector<int> mHistory;
+  std::vector<Task> mTasks;
+};
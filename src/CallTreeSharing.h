@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "TraceCallTree.h"
+
+inline uint64_t combineCallTreeHash(uint64_t iSeed, uint64_t iValue)
+{
+  return iSeed ^ (iValue + 0x9e3779b97f4a7c15ull + (iSeed << 6) + (iSeed >> 2));
+}
+
+// Hash of what the printers show of a record: its address and instruction,
+// and the function a call enters
+template<class TRecord>
+uint64_t callTreeRecordHash(const TRecord& record)
+{
+  uint64_t iHash = std::hash<std::string_view>()(record.msAddress);
+  iHash = combineCallTreeHash(iHash, std::hash<std::string_view>()(record.msInstruction));
+  if (record.mInstruction_kind == IdaInstructionKind::Call)
+  {
+    iHash = combineCallTreeHash(iHash, (static_cast<uint64_t>(record.getResultModule()) << 32) | record.getResultOther());
+  }
+  return iHash;
+}
+
+template<class TRecord>
+bool isSameCallTreeRecord(const TRecord& a, const TRecord& b)
+{
+  if (a.msAddress != b.msAddress || a.msInstruction != b.msInstruction)
+  {
+    return false;
+  }
+  return a.mInstruction_kind != IdaInstructionKind::Call
+    || (a.getResultModule() == b.getResultModule() && a.getResultOther() == b.getResultOther());
+}
+
+struct CallTreeSharingStats
+{
+  // Subtrees found more than once
+  uint64_t iShared = 0;
+  // Calls whose subtree was dropped for one of them
+  uint64_t iReferences = 0;
+  uint64_t iNodesDropped = 0;
+};
+
+// Builds a CallTree like CallTreeAppender, but a call whose subtree repeats
+// an earlier one keeps no children: it becomes a reference (bSharedRef) to
+// that subtree, which counts the calls sharing it in iRepeats.
+// A subtree is hashed bottom-up once its last record is in. Its nodes are
+// the newest of the arena then, so a repeated one is cut off at the end.
+template<class T>
+class CallTreeSharingAppender
+{
+public:
+  explicit CallTreeSharingAppender(CallTree<T>& tree)
+    : mTree(tree)
+    , mOpen{ { tree.reset(), 0 } }
+  {
+  }
+
+  void operator()(T& value, int iDepth)
+  {
+    // Records arrive in pre-order, the calls at iDepth and below are complete
+    closeTo(static_cast<size_t>(iDepth));
+    const CallTreeNodeId iNode = mTree.appendNode(mOpen.back().iNode, std::move(value));
+    mOpen.push_back({ iNode, 0 });
+  }
+
+  // Shares the subtrees still open at the end of the trace
+  void finish()
+  {
+    closeTo(1);
+  }
+
+  const CallTreeSharingStats& stats() const { return mStats; }
+
+private:
+  struct OpenNode
+  {
+    CallTreeNodeId iNode;
+    // Hashes of the children so far, in order
+    uint64_t iChildrenHash;
+  };
+
+  void closeTo(size_t iDepth)
+  {
+    while (mOpen.size() > iDepth)
+    {
+      const OpenNode open = mOpen.back();
+      mOpen.pop_back();
+
+      CallTreeNode<T>& node = mTree.node(open.iNode);
+      uint64_t iHash = callTreeRecordHash(node.value);
+      if (node.iFirstChild != kNoCallTreeNode)
+      {
+        iHash = combineCallTreeHash(iHash, open.iChildrenHash);
+        share(open.iNode, iHash);
+      }
+      mOpen.back().iChildrenHash = combineCallTreeHash(mOpen.back().iChildrenHash, iHash);
+    }
+  }
+
+  void share(CallTreeNodeId iNode, uint64_t iHash)
+  {
+    CallTreeNode<T>& node = mTree.node(iNode);
+    const auto range = mSubtrees.equal_range(iHash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+      CallTreeNode<T>& first = mTree.node(it->second);
+      if (!isSameSubtree(first, node))
+      {
+        continue;
+      }
+
+      if (first.iShared == 0)
+      {
+        first.iShared = static_cast<uint32_t>(++mStats.iShared);
+      }
+      ++first.iRepeats;
+      ++mStats.iReferences;
+
+      // Only complete calls follow the node in the arena
+      mStats.iNodesDropped += mTree.size() - (iNode + 1);
+      mTree.truncate(iNode + 1);
+      node.iFirstChild = kNoCallTreeNode;
+      node.iLastChild = kNoCallTreeNode;
+      node.iShared = first.iShared;
+      node.bSharedRef = true;
+      return;
+    }
+    mSubtrees.emplace(iHash, iNode);
+  }
+
+  // The children of both are already shared, so comparing one level is
+  // enough: leaves must match, calls must refer to the same subtree
+  bool isSameSubtree(CallTreeNode<T>& first, CallTreeNode<T>& node)
+  {
+    if (!isSameCallTreeRecord(first.value, node.value))
+    {
+      return false;
+    }
+
+    CallTreeNodeId iFirstChild = first.iFirstChild;
+    CallTreeNodeId iChild = node.iFirstChild;
+    while (iFirstChild != kNoCallTreeNode && iChild != kNoCallTreeNode)
+    {
+      CallTreeNode<T>& firstChild = mTree.node(iFirstChild);
+      CallTreeNode<T>& child = mTree.node(iChild);
+      if (!isSameCallTreeRecord(firstChild.value, child.value))
+      {
+        return false;
+      }
+      if (child.bSharedRef)
+      {
+        if (firstChild.iShared != child.iShared)
+        {
+          return false;
+        }
+      }
+      else if (child.iFirstChild != kNoCallTreeNode || firstChild.iFirstChild != kNoCallTreeNode || firstChild.bSharedRef)
+      {
+        // A child with a subtree of its own is the first of its kind
+        return false;
+      }
+      iFirstChild = firstChild.iNextSibling;
+      iChild = child.iNextSibling;
+    }
+    return iFirstChild == iChild;
+  }
+
+  CallTree<T>& mTree;
+  // Path from the root to the last record
+  std::vector<OpenNode> mOpen;
+  // Subtrees with children that were seen first, by hash
+  std::unordered_multimap<uint64_t, CallTreeNodeId> mSubtrees;
+  CallTreeSharingStats mStats;
+};
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "IdaTraceRecordView.h"
+#include "TraceCallTree.h"
+
+// Records are spilled as their four cells and made again from them, like
+// when the trace is read. Views point into the buffer the cells were read to.
+inline void restoreSpilledRecord(IdaTraceFileRecord& record, const std::string_view (&cells)[4])
+{
+  record = IdaTraceFileRecord(std::string(cells[0]), std::string(cells[1]), std::string(cells[2]), std::string(cells[3]));
+}
+
+inline void restoreSpilledRecord(IdaTraceRecordView& record, const std::string_view (&cells)[4])
+{
+  record = IdaTraceRecordView(cells[0], cells[1], cells[2], cells[3]);
+}
+
+struct CallTreeSpillStats
+{
+  uint64_t iSpills = 0;
+  uint64_t iNodes = 0;
+  uint64_t iBytes = 0;
+};
+
+// Call tree whose nodes are moved to a spill file when they take more than
+// a memory limit. Every node is written out once with its depth and its
+// position in pre-order, and the resident tree is rebuilt from the calls
+// still open, which later records are appended to. Each spill only holds
+// nodes newer than the last one, so the file stays in pre-order.
+// traverse() streams the spilled nodes back and merges them with the
+// resident ones, so callbacks see the same pre-order walk as on a CallTree.
+// A node handed to a callback is only valid during the call, apart from its
+// ancestors: printers must not keep node addresses.
+//
+// Used as the sink of IdaCallStackBuilder in place of CallTreeAppender.
+template<class T>
+class CallTreeSpill
+{
+public:
+  CallTreeSpill(std::string sSpillFile, uint64_t iMemoryLimit)
+    : msSpillFile(std::move(sSpillFile))
+    , miMemoryLimit(iMemoryLimit)
+  {
+    mPath.push_back(mTree.reset());
+    mResidentOrder.push_back(0);
+    miNodes = 1;
+  }
+
+  ~CallTreeSpill()
+  {
+    mSpillOutput.close();
+    if (mStats.iSpills != 0)
+    {
+      std::remove(msSpillFile.c_str());
+    }
+  }
+
+  CallTreeSpill(const CallTreeSpill&) = delete;
+  CallTreeSpill& operator=(const CallTreeSpill&) = delete;
+
+  void operator()(T& value, int iDepth)
+  {
+    miResidentBytes += kNodeBytes + value.heapBytes();
+    const CallTreeNodeId iNode = mTree.appendNode(mPath[iDepth - 1], std::move(value));
+    mPath.resize(iDepth);
+    mPath.push_back(iNode);
+    mResidentOrder.push_back(miNodes++);
+
+    // Open calls alone may take more than the limit, then a spill only
+    // comes once the nodes added since the last one take a quarter of it
+    if (miResidentBytes > miMemoryLimit && miResidentBytes - miSpillResidentBytes >= miMemoryLimit / 4 && mTree.size() > mPath.size())
+    {
+      spill();
+    }
+  }
+
+  // Nodes of the whole tree, spilled or not
+  size_t size() const { return static_cast<size_t>(miNodes); }
+
+  const CallTreeSpillStats& stats() const { return mStats; }
+
+  // False once writing to the spill file failed, the spilled nodes are incomplete
+  bool good() const { return mStats.iSpills == 0 || static_cast<bool>(mSpillOutput); }
+
+  bool traverse(CallTreeCallback<T> callback, int iDepth, void* pContext)
+  {
+    if (mStats.iSpills == 0)
+    {
+      return mTree.traverse(callback, iDepth, pContext);
+    }
+    mSpillOutput.flush();
+
+    SpillReader spilled(msSpillFile);
+    ResidentWalk resident(mTree, mResidentOrder);
+    std::vector<CallTreeNode<T>*> ancestors;
+    int iSkipDepth = -1;
+    while (!spilled.done() || !resident.done())
+    {
+      CallTreeNode<T>* pNode;
+      int iNodeDepth;
+      if (resident.done() || (!spilled.done() && spilled.order() < resident.order()))
+      {
+        iNodeDepth = static_cast<int>(spilled.depth());
+        if (iSkipDepth >= 0 && iNodeDepth > iSkipDepth)
+        {
+          spilled.skip();
+          continue;
+        }
+        // Spilled nodes are made again in one slot per depth
+        if (mRestored.size() <= static_cast<size_t>(iNodeDepth))
+        {
+          mRestored.resize(static_cast<size_t>(iNodeDepth) + 1);
+          mRestoredCells.resize(static_cast<size_t>(iNodeDepth) + 1);
+        }
+        pNode = &mRestored[iNodeDepth];
+        spilled.read(pNode->value, mRestoredCells[iNodeDepth]);
+        pNode->pParent = ancestors[iNodeDepth - 1];
+      }
+      else
+      {
+        iNodeDepth = resident.depth();
+        pNode = resident.node();
+        const CallTreeNodeId iNode = resident.id();
+        resident.next();
+        // The open calls of the last spill were written with it
+        if ((iNode > 0 && iNode < miWrittenPath) || (iSkipDepth >= 0 && iNodeDepth > iSkipDepth))
+        {
+          continue;
+        }
+      }
+
+      iSkipDepth = -1;
+      ancestors.resize(static_cast<size_t>(iNodeDepth));
+      ancestors.push_back(pNode);
+      if (!callback(*pNode, iDepth + iNodeDepth, pContext))
+      {
+        if (iNodeDepth == 0)
+        {
+          return false;
+        }
+        iSkipDepth = iNodeDepth;
+      }
+    }
+    return true;
+  }
+
+private:
+  // A resident node and its position in pre-order
+  static constexpr uint64_t kNodeBytes = sizeof(CallTreeNode<T>) + sizeof(uint64_t);
+
+  // Writes out the nodes not written yet and keeps the open calls only
+  void spill()
+  {
+    if (!mSpillOutput.is_open())
+    {
+      mSpillOutput.open(msSpillFile, std::ios::binary | std::ios::trunc);
+    }
+
+    std::vector<std::pair<uint64_t, T>> open;
+    ResidentWalk resident(mTree, mResidentOrder);
+    for (; !resident.done(); resident.next())
+    {
+      const int iDepth = resident.depth();
+      CallTreeNode<T>* pNode = resident.node();
+      if (resident.id() >= miWrittenPath)
+      {
+        write(resident.order(), static_cast<uint32_t>(iDepth), pNode->value);
+      }
+      if (static_cast<size_t>(iDepth) < mPath.size() && mPath[iDepth] == resident.id())
+      {
+        open.emplace_back(resident.order(), std::move(pNode->value));
+      }
+    }
+    ++mStats.iSpills;
+
+    // The open calls form a chain from the root
+    mTree.reset();
+    mPath.assign(1, 0);
+    mResidentOrder.assign(1, 0);
+    miResidentBytes = kNodeBytes;
+    for (size_t i = 1; i < open.size(); ++i)
+    {
+      miResidentBytes += kNodeBytes + open[i].second.heapBytes();
+      mPath.push_back(mTree.appendNode(mPath.back(), std::move(open[i].second)));
+      mResidentOrder.push_back(open[i].first);
+    }
+    miWrittenPath = mPath.size();
+    miSpillResidentBytes = miResidentBytes;
+  }
+
+  void write(uint64_t iOrder, uint32_t iDepth, const T& value)
+  {
+    const std::string_view cells[4] = { value.msThread, value.msAddress, value.msInstruction, value.msResult };
+    uint32_t lengths[4];
+    for (int i = 0; i < 4; ++i)
+    {
+      lengths[i] = static_cast<uint32_t>(cells[i].length());
+    }
+    mSpillOutput.write(reinterpret_cast<const char*>(&iOrder), sizeof(iOrder));
+    mSpillOutput.write(reinterpret_cast<const char*>(&iDepth), sizeof(iDepth));
+    mSpillOutput.write(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+    uint64_t iBytes = sizeof(iOrder) + sizeof(iDepth) + sizeof(lengths);
+    for (const auto sCell : cells)
+    {
+      mSpillOutput.write(sCell.data(), static_cast<std::streamsize>(sCell.length()));
+      iBytes += sCell.length();
+    }
+    ++mStats.iNodes;
+    mStats.iBytes += iBytes;
+  }
+
+  // Entries of the spill file front to back: order, depth, cell lengths, cells
+  class SpillReader
+  {
+  public:
+    explicit SpillReader(const std::string& sPath)
+      : mInput(sPath, std::ios::binary)
+    {
+      readHeader();
+    }
+
+    bool done() const { return mbDone; }
+    uint64_t order() const { return miOrder; }
+    uint32_t depth() const { return miDepth; }
+
+    // The cells are read to buffer, which must live as long as the record
+    void read(T& value, std::string& buffer)
+    {
+      buffer.resize(static_cast<size_t>(miLengths[0]) + miLengths[1] + miLengths[2] + miLengths[3]);
+      mInput.read(&buffer[0], static_cast<std::streamsize>(buffer.length()));
+      std::string_view cells[4];
+      size_t iPos = 0;
+      for (int i = 0; i < 4; ++i)
+      {
+        cells[i] = std::string_view(buffer).substr(iPos, miLengths[i]);
+        iPos += miLengths[i];
+      }
+      restoreSpilledRecord(value, cells);
+      readHeader();
+    }
+
+    void skip()
+    {
+      mInput.seekg(static_cast<std::streamoff>(miLengths[0]) + miLengths[1] + miLengths[2] + miLengths[3], std::ios::cur);
+      readHeader();
+    }
+
+  private:
+    void readHeader()
+    {
+      mInput.read(reinterpret_cast<char*>(&miOrder), sizeof(miOrder));
+      mInput.read(reinterpret_cast<char*>(&miDepth), sizeof(miDepth));
+      mInput.read(reinterpret_cast<char*>(miLengths), sizeof(miLengths));
+      mbDone = !mInput;
+    }
+
+    std::ifstream mInput;
+    bool mbDone = false;
+    uint64_t miOrder = 0;
+    uint32_t miDepth = 0;
+    uint32_t miLengths[4] = {};
+  };
+
+  // Pre-order walk of the resident tree, one node at a time
+  class ResidentWalk
+  {
+  public:
+    ResidentWalk(CallTree<T>& tree, const std::vector<uint64_t>& order)
+      : mTree(tree)
+      , mOrder(order)
+    {
+    }
+
+    bool done() const { return miNode == kNoCallTreeNode; }
+    CallTreeNodeId id() const { return miNode; }
+    CallTreeNode<T>* node() const { return &mTree.node(miNode); }
+    int depth() const { return miDepth; }
+    uint64_t order() const { return mOrder[miNode]; }
+
+    void next()
+    {
+      CallTreeNode<T>* pNode = node();
+      if (pNode->iFirstChild != kNoCallTreeNode)
+      {
+        miNode = pNode->iFirstChild;
+        ++miDepth;
+        return;
+      }
+      while (pNode->iNextSibling == kNoCallTreeNode)
+      {
+        if (pNode->pParent == nullptr)
+        {
+          miNode = kNoCallTreeNode;
+          return;
+        }
+        pNode = pNode->pParent;
+        --miDepth;
+      }
+      miNode = pNode->iNextSibling;
+    }
+
+  private:
+    CallTree<T>& mTree;
+    const std::vector<uint64_t>& mOrder;
+    CallTreeNodeId miNode = 0;
+    int miDepth = 0;
+  };
+
+  const std::string msSpillFile;
+  const uint64_t miMemoryLimit;
+
+  // Open calls and the complete nodes since the last spill
+  CallTree<T> mTree;
+  // Resident ids of the calls from the root to the last node
+  std::vector<CallTreeNodeId> mPath;
+  // Position in the pre-order of the whole tree, by resident id
+  std::vector<uint64_t> mResidentOrder;
+  uint64_t miResidentBytes = kNodeBytes;
+  // miResidentBytes right after the last spill
+  uint64_t miSpillResidentBytes = 0;
+  uint64_t miNodes = 0;
+  // Resident nodes below this id, the open calls kept by the last spill and
+  // the root, are in the spill file already or never written
+  size_t miWrittenPath = 1;
+
+  std::ofstream mSpillOutput;
+  // Spilled nodes being visited and the cells of their records, by depth;
+  // deques keep them in place while deeper ones are added
+  std::deque<CallTreeNode<T>> mRestored;
+  std::deque<std::string> mRestoredCells;
+  CallTreeSpillStats mStats;
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "SymbolTable.h"
+
+// Plain names of called functions ("funcB" for "void __cdecl funcB(int)") as
+// symbols. A name is derived once per result symbol; calls whose result does
+// not name the callee fall back to the operand of the instruction.
+class CalleeNames
+{
+public:
+  static std::string_view plainName(std::string_view sFunction)
+  {
+    std::string_view sName = IdaTraceFileRecord::getFunctionNameOnly(sFunction);
+    sName.remove_prefix(std::min(sName.find_first_not_of(' '), sName.length()));
+    return sName;
+  }
+
+  template<class TRecord>
+  SymbolId get(const TRecord& record)
+  {
+    const SymbolId iOther = record.getResultOther();
+    if (iOther < mNames.size() && mNames[iOther] != kUnknown)
+    {
+      return mNames[iOther];
+    }
+
+    const std::string_view sName = plainName(symbolName(iOther));
+    if (sName.empty())
+    {
+      return internSymbol(plainName(record.getFunctionNameFromInstruction()));
+    }
+
+    if (iOther >= mNames.size())
+    {
+      mNames.resize(iOther + 1, kUnknown);
+    }
+    mNames[iOther] = internSymbol(sName);
+    return mNames[iOther];
+  }
+
+private:
+  static constexpr SymbolId kUnknown = ~SymbolId(0);
+
+  std::vector<SymbolId> mNames;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "CalleeNames.h"
+#include "IdaTraceFilters.h"
+#include "OutputBuffer.h"
+#include "SymbolTable.h"
+#include "TraceCallTree.h"
+
+// Instruction and call counts per call path. Records are added in pre-order
+// with their depth, straight from IdaCallStackBuilder or from a CallTree
+// traversal; only one node per distinct path is kept, never the records.
+// A call record opens the path of its callee for the records below it.
+class IdaCallPathProfile
+{
+public:
+  IdaCallPathProfile()
+  {
+    beginRoot("[trace]");
+  }
+
+  const IdaTraceFilters* pFilters = nullptr;
+
+  // Following records belong to a new top frame, e.g. a traced thread
+  void beginRoot(std::string_view sName)
+  {
+    mPathAtDepth.assign(1, childPath(kNoPath, internSymbol(sName)));
+    miSkipDepth = -1;
+  }
+
+  // False when the record is skipped by the filters, its subtree must not be
+  // added either
+  template<class TRecord>
+  bool add(const TRecord& record, int iDepth)
+  {
+    // Root of a tree
+    if (iDepth == 0)
+    {
+      return true;
+    }
+    if (pFilters != nullptr && pFilters->isSkipped(record))
+    {
+      return false;
+    }
+    // Inserted by IdaCallStackBuilder, not executed
+    if (record.getInstructionName() == "error")
+    {
+      return true;
+    }
+
+    mPathAtDepth.resize(iDepth);
+    const uint32_t iPath = mPathAtDepth.back();
+    ++mNodes[iPath].iSelf;
+
+    if (record.mInstruction_kind == IdaInstructionKind::Call)
+    {
+      const uint32_t iCallee = childPath(iPath, mCalleeNames.get(record));
+      ++mNodes[iCallee].iCalls;
+      mPathAtDepth.push_back(iCallee);
+    }
+    else
+    {
+      mPathAtDepth.push_back(iPath);
+    }
+    return true;
+  }
+
+  // Sink for IdaCallStackBuilder
+  template<class TRecord>
+  void operator()(const TRecord& record, int iDepth)
+  {
+    if (miSkipDepth >= 0)
+    {
+      if (iDepth > miSkipDepth)
+      {
+        return;
+      }
+      miSkipDepth = -1;
+    }
+    if (!add(record, iDepth))
+    {
+      miSkipDepth = iDepth;
+    }
+  }
+
+  // Number of distinct paths, the top frames included
+  size_t size() const { return mNodes.size(); }
+
+  // One "frame;frame;... count" line per path that executed instructions
+  // itself, the input of flamegraph.pl
+  void writeFolded(OutputBuffer& output) const
+  {
+    std::vector<uint32_t> frames;
+    for (uint32_t iPath = 0; iPath < mNodes.size(); ++iPath)
+    {
+      if (mNodes[iPath].iSelf == 0)
+      {
+        continue;
+      }
+
+      frames.clear();
+      for (uint32_t iFrame = iPath; iFrame != kNoPath; iFrame = mNodes[iFrame].iParent)
+      {
+        frames.push_back(iFrame);
+      }
+      for (auto itFrame = frames.rbegin(); itFrame != frames.rend(); ++itFrame)
+      {
+        if (itFrame != frames.rbegin())
+        {
+          output << ';';
+        }
+        output << symbolName(mNodes[*itFrame].iFunction);
+      }
+      output << ' ' << mNodes[iPath].iSelf << '\n';
+    }
+  }
+
+  // Functions by inclusive instruction count. A recursive function counts
+  // the instructions below its outermost frame once.
+  void writeTop(OutputBuffer& output, size_t iCount) const
+  {
+    struct FunctionCounts
+    {
+      SymbolId iFunction = 0;
+      uint64_t iInclusive = 0;
+      uint64_t iExclusive = 0;
+      uint64_t iCalls = 0;
+    };
+
+    std::vector<uint64_t> inclusive(mNodes.size());
+    std::vector<uint32_t> firstChild(mNodes.size(), kNoPath);
+    std::vector<uint32_t> nextSibling(mNodes.size(), kNoPath);
+    uint64_t iTotal = 0;
+    // Children are created after their parent
+    for (uint32_t iPath = static_cast<uint32_t>(mNodes.size()); iPath-- > 0;)
+    {
+      inclusive[iPath] += mNodes[iPath].iSelf;
+      const uint32_t iParent = mNodes[iPath].iParent;
+      if (iParent == kNoPath)
+      {
+        iTotal += inclusive[iPath];
+        continue;
+      }
+      inclusive[iParent] += inclusive[iPath];
+      nextSibling[iPath] = firstChild[iParent];
+      firstChild[iParent] = iPath;
+    }
+
+    std::unordered_map<SymbolId, FunctionCounts> functions;
+    std::unordered_map<SymbolId, uint32_t> activeFrames;
+    std::vector<uint32_t> pending;
+    // Every path is below exactly one top frame, so it is only entered once
+    std::vector<bool> entered(mNodes.size());
+    for (uint32_t iPath = 0; iPath < mNodes.size(); ++iPath)
+    {
+      if (mNodes[iPath].iParent != kNoPath)
+      {
+        continue;
+      }
+
+      // Depth-first over one top frame; a path is entered when first seen on
+      // the pending stack and left when seen again
+      for (uint32_t iChild = firstChild[iPath]; iChild != kNoPath; iChild = nextSibling[iChild])
+      {
+        pending.push_back(iChild);
+      }
+      while (!pending.empty())
+      {
+        const uint32_t iNode = pending.back();
+        const SymbolId iFunction = mNodes[iNode].iFunction;
+        if (entered[iNode])
+        {
+          pending.pop_back();
+          --activeFrames[iFunction];
+          continue;
+        }
+        entered[iNode] = true;
+
+        FunctionCounts& counts = functions[iFunction];
+        counts.iFunction = iFunction;
+        counts.iExclusive += mNodes[iNode].iSelf;
+        counts.iCalls += mNodes[iNode].iCalls;
+        if (activeFrames[iFunction]++ == 0)
+        {
+          counts.iInclusive += inclusive[iNode];
+        }
+        for (uint32_t iChild = firstChild[iNode]; iChild != kNoPath; iChild = nextSibling[iChild])
+        {
+          pending.push_back(iChild);
+        }
+      }
+    }
+
+    std::vector<FunctionCounts> sorted;
+    sorted.reserve(functions.size());
+    for (const auto& function : functions)
+    {
+      sorted.push_back(function.second);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const FunctionCounts& left, const FunctionCounts& right)
+    {
+      if (left.iInclusive != right.iInclusive)
+      {
+        return left.iInclusive > right.iInclusive;
+      }
+      return symbolName(left.iFunction) < symbolName(right.iFunction);
+    });
+    if (sorted.size() > iCount)
+    {
+      sorted.resize(iCount);
+    }
+
+    output << "instructions = " << iTotal << ", paths = " << mNodes.size() << ", functions = " << functions.size() << '\n';
+    output << "\n    inclusive    exclusive        calls  function\n";
+    for (const auto& counts : sorted)
+    {
+      writeColumn(output, counts.iInclusive);
+      writeColumn(output, counts.iExclusive);
+      writeColumn(output, counts.iCalls);
+      output << "  " << symbolName(counts.iFunction) << '\n';
+    }
+  }
+
+private:
+  static constexpr uint32_t kNoPath = ~uint32_t(0);
+  static constexpr int kColumnWidth = 12;
+
+  struct PathNode
+  {
+    SymbolId iFunction;
+    uint32_t iParent;
+    uint64_t iSelf;
+    uint64_t iCalls;
+  };
+
+  static void writeColumn(OutputBuffer& output, uint64_t iValue)
+  {
+    const std::string sValue = std::to_string(iValue);
+    for (int i = static_cast<int>(sValue.length()); i < kColumnWidth; ++i)
+    {
+      output << ' ';
+    }
+    output << ' ' << sValue;
+  }
+
+  uint32_t childPath(uint32_t iParent, SymbolId iFunction)
+  {
+    const uint64_t iKey = (static_cast<uint64_t>(iParent) << 32) | iFunction;
+    const auto itPath = mPathIndex.emplace(iKey, static_cast<uint32_t>(mNodes.size()));
+    if (itPath.second)
+    {
+      mNodes.push_back({ iFunction, iParent, 0, 0 });
+    }
+    return itPath.first->second;
+  }
+
+  std::vector<PathNode> mNodes;
+  std::unordered_map<uint64_t, uint32_t> mPathIndex;
+  CalleeNames mCalleeNames;
+
+  // Path of the records below the last record of every depth
+  std::vector<uint32_t> mPathAtDepth;
+  int miSkipDepth = -1;
+};
+
+template<class TRecord>
+bool treeProfileCollector(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  return static_cast<IdaCallPathProfile*>(pContext)->add(info.value, iDepth);
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "SymbolTable.h"
+
+// What IdaCallStackBuilder had to repair in a trace with missing returns
+struct IdaCallStackStats
+{
+  // Returns that closed more than the innermost call
+  uint64_t iRepairs = 0;
+  // Calls closed by those returns without one of their own
+  uint64_t iFramesDropped = 0;
+  // Returns with no open call, each followed by an "error" record
+  uint64_t iUnmatchedReturns = 0;
+  // Deepest record
+  uint64_t iMaxDepth = 0;
+
+  IdaCallStackStats& operator+=(const IdaCallStackStats& other)
+  {
+    iMaxDepth = std::max(iMaxDepth, other.iMaxDepth);
+    iRepairs += other.iRepairs;
+    iFramesDropped += other.iFramesDropped;
+    iUnmatchedReturns += other.iUnmatchedReturns;
+    return *this;
+  }
+};
+
+// Tab separated line per repair, may be shared by builders on several threads
+struct IdaCallStackRepairLog
+{
+  std::ostream* pOutput = nullptr;
+  std::mutex mutex;
+  // Trace the following repairs are made in, written as a first column when
+  // the log covers two traces (--diff); empty for no such column
+  std::string sInput;
+
+  void writeHeader()
+  {
+    *pOutput << (sInput.empty() ? "" : "input\t") << "dropped\tfunction\taddress\tinstruction\tresult\n";
+  }
+
+  template<class TRecord>
+  void write(size_t iDropped, const TRecord& record)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!sInput.empty())
+    {
+      *pOutput << sInput << '\t';
+    }
+    *pOutput << iDropped << '\t' << symbolName(record.getResultOther()) << '\t' << record.msAddress << '\t' << record.msInstruction << '\t' << record.msResult << '\n';
+  }
+};
+
+// Reconstructs the call nesting of trace records using only the live call
+// stack. Every record is handed to the sink together with its depth in the
+// call tree (the root is depth 0), in the same pre-order a CallTree traversal
+// visits them. A return that leaves the stack empty is followed by an
+// "error" record one level deeper.
+//
+// The sink is called as sink(TRecord& record, int iDepth) and may move the
+// record away.
+template<class TRecord>
+class IdaCallStackBuilder
+{
+public:
+  IdaCallStackBuilder()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    mStack.clear();
+    mTopFrame.clear();
+    pushFrame(0);
+    mStats = IdaCallStackStats();
+    mbPrevCall = false;
+    miPrevResult_func = 0;
+    miPrevAddress_func = 0;
+  }
+
+  template<class TSink>
+  void append(TRecord& record, TSink&& sink)
+  {
+    if (mbPrevCall && record.miResult_func != miPrevResult_func)
+    {
+      pushFrame(miPrevAddress_func);
+    }
+
+    const int iDepth = static_cast<int>(mStack.size());
+    if (static_cast<uint64_t>(iDepth) > mStats.iMaxDepth)
+    {
+      mStats.iMaxDepth = static_cast<uint64_t>(iDepth);
+    }
+    mbPrevCall = record.mInstruction_kind == IdaInstructionKind::Call;
+    miPrevResult_func = record.miResult_func;
+    miPrevAddress_func = record.miAddress_func;
+
+    bool bError = false;
+    if (record.isReturn())
+    {
+      fixStack(record);
+
+      if (mStack.size() > 1)
+      {
+        popFrame();
+      }
+      else
+      {
+        bError = true;
+        ++mStats.iUnmatchedReturns;
+      }
+    }
+
+    sink(record, iDepth);
+
+    if (bError)
+    {
+      TRecord error("error", "error", "error", "error");
+      sink(error, iDepth + 1);
+    }
+  }
+
+  // Number of open calls
+  size_t depth() const { return mStack.size() - 1; }
+
+  const IdaCallStackStats& stats() const { return mStats; }
+
+  // Every repair is also written to the log, nullptr for none
+  void setRepairLog(IdaCallStackRepairLog* pLog) { mpRepairLog = pLog; }
+
+private:
+  static constexpr uint32_t kNoFrame = ~uint32_t(0);
+
+  struct Frame
+  {
+    SymbolId iFunction;
+    // Next frame of the same function towards the root
+    uint32_t iPrevSame;
+  };
+
+  void pushFrame(SymbolId iFunction)
+  {
+    if (iFunction >= mTopFrame.size())
+    {
+      mTopFrame.resize(iFunction + 1, kNoFrame);
+    }
+    mStack.push_back({ iFunction, mTopFrame[iFunction] });
+    mTopFrame[iFunction] = static_cast<uint32_t>(mStack.size() - 1);
+  }
+
+  void popFrame()
+  {
+    mTopFrame[mStack.back().iFunction] = mStack.back().iPrevSame;
+    mStack.pop_back();
+  }
+
+  // A return names the function it leaves; the calls opened after the
+  // innermost frame of that function never returned and are closed here
+  void fixStack(const TRecord& record)
+  {
+    const SymbolId iFunction = record.getResultOther();
+    if (iFunction >= mTopFrame.size() || mTopFrame[iFunction] == kNoFrame)
+    {
+      return;
+    }
+
+    const size_t iDropped = mStack.size() - 1 - mTopFrame[iFunction];
+    if (iDropped == 0)
+    {
+      return;
+    }
+
+    ++mStats.iRepairs;
+    mStats.iFramesDropped += iDropped;
+    if (mpRepairLog != nullptr)
+    {
+      mpRepairLog->write(iDropped, record);
+    }
+
+    for (size_t i = 0; i < iDropped; ++i)
+    {
+      popFrame();
+    }
+  }
+
+  // Open calls, the root first
+  std::vector<Frame> mStack;
+  // Innermost frame of every function, indexed by SymbolId
+  std::vector<uint32_t> mTopFrame;
+
+  IdaCallStackStats mStats;
+  IdaCallStackRepairLog* mpRepairLog = nullptr;
+
+  bool mbPrevCall = false;
+  SymbolId miPrevResult_func = 0;
+  SymbolId miPrevAddress_func = 0;
+};
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "IdaTraceFilters.h"
+#include "IdaTreePrinters.h"
+#include "OutputBuffer.h"
+#include "SymbolTable.h"
+#include "TraceCallTree.h"
+
+// Where the dot graph of a call tree is cut into graphs of its own
+struct IdaDotShardOptions
+{
+  // Calls at this depth are drawn in their own graph, 0 for none
+  int iDepth = 0;
+  // Most nodes drawn in one graph, 0 for no limit. The children of a node
+  // that do not fit continue in a chain of further graphs; a single record
+  // with a subtree larger than that is never split below it.
+  uint64_t iMaxNodes = 0;
+  // Graphs written at the same time, 0 for one per core
+  unsigned iWorkers = 0;
+};
+
+template<class TRecord>
+struct IdaDotShard
+{
+  // The top of the tree for the first shard, a call drawn with its subtree,
+  // or the first of a run of siblings continuing the previous shard
+  CallTreeNode<TRecord>* pRoot = nullptr;
+  bool bContinued = false;
+  // Shard linking here
+  size_t iParent = 0;
+  uint64_t iNodes = 0;
+  std::string sPath;
+};
+
+struct IdaDotShardStats
+{
+  size_t iShards = 0;
+  uint64_t iNodes = 0;
+  uint64_t iBytes = 0;
+};
+
+// Cut calls and continued runs by their first node, with the shard drawing them
+template<class TRecord>
+struct IdaDotShardCuts
+{
+  std::unordered_map<const CallTreeNode<TRecord>*, size_t> calls;
+  std::unordered_map<const CallTreeNode<TRecord>*, size_t> runs;
+};
+
+// Plans the cuts bottom-up: a node keeps the nodes of its subtree that are
+// not cut away, a cut call stays as a link and a continued run as one node
+template<class TRecord>
+struct IdaDotShardPlanContext
+{
+  struct OpenNode
+  {
+    CallTreeNode<TRecord>* pNode;
+    int iDepth;
+    uint64_t iKept;
+    // Every child with the number of nodes it keeps
+    std::vector<std::pair<CallTreeNode<TRecord>*, uint64_t>> children;
+  };
+
+  const IdaTraceFilters* pFilters = nullptr;
+  IdaDotShardOptions options;
+  std::vector<OpenNode> open;
+  IdaDotShardCuts<TRecord> cuts;
+
+  void closeTo(int iDepth)
+  {
+    while (!open.empty() && open.back().iDepth >= iDepth)
+    {
+      close();
+    }
+  }
+
+  void close()
+  {
+    OpenNode node = std::move(open.back());
+    open.pop_back();
+
+    if (options.iMaxNodes > 0 && node.iKept > options.iMaxNodes)
+    {
+      // The first run stays with the node and a link, the others need a
+      // link to the next run
+      const uint64_t iFirstRun = options.iMaxNodes > 2 ? options.iMaxNodes - 2 : 1;
+      const uint64_t iRun = options.iMaxNodes > 1 ? options.iMaxNodes - 1 : 1;
+      uint64_t iKept = 0;
+      uint64_t iRunKept = 0;
+      bool bFirst = true;
+      for (const auto& child : node.children)
+      {
+        if (iRunKept > 0 && iRunKept + child.second > (bFirst ? iFirstRun : iRun))
+        {
+          if (bFirst)
+          {
+            iKept = iRunKept;
+            bFirst = false;
+          }
+          cuts.runs.emplace(child.first, 0);
+          iRunKept = 0;
+        }
+        iRunKept += child.second;
+      }
+      node.iKept = 1 + (bFirst ? iRunKept : iKept + 1);
+    }
+    std::vector<std::pair<CallTreeNode<TRecord>*, uint64_t>>().swap(node.children);
+    if (open.empty())
+    {
+      return;
+    }
+
+    if (options.iDepth > 0 && node.iDepth == options.iDepth && node.iKept > 1)
+    {
+      cuts.calls.emplace(node.pNode, 0);
+      node.iKept = 1;
+    }
+    open.back().iKept += node.iKept;
+    open.back().children.emplace_back(node.pNode, node.iKept);
+  }
+};
+
+template<class TRecord>
+bool dotShardPlanner(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  IdaDotShardPlanContext<TRecord>* pPlan = static_cast<IdaDotShardPlanContext<TRecord>*>(pContext);
+  pPlan->closeTo(iDepth);
+  // Filtered subtrees are not drawn at all
+  if (iDepth > 0 && pPlan->pFilters != nullptr && pPlan->pFilters->isSkipped(info.value))
+  {
+    return false;
+  }
+  pPlan->open.push_back({ &info, iDepth, 1, {} });
+  return true;
+}
+
+// Numbers the shards in pre-order and counts their nodes
+template<class TRecord>
+struct IdaDotShardNumberContext
+{
+  struct OpenShard
+  {
+    // Nodes above this depth are outside the shard
+    int iMinDepth;
+    size_t iShard;
+  };
+
+  const IdaTraceFilters* pFilters = nullptr;
+  IdaDotShardCuts<TRecord>* pCuts = nullptr;
+  std::vector<IdaDotShard<TRecord>>* pShards = nullptr;
+  std::vector<OpenShard> open;
+
+  void addShard(CallTreeNode<TRecord>* pRoot, bool bContinued, int iMinDepth, size_t& iShard)
+  {
+    iShard = pShards->size();
+    pShards->emplace_back();
+    pShards->back().pRoot = pRoot;
+    pShards->back().bContinued = bContinued;
+    pShards->back().iParent = open.empty() ? 0 : open.back().iShard;
+    open.push_back({ iMinDepth, iShard });
+  }
+};
+
+template<class TRecord>
+bool dotShardNumberer(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  IdaDotShardNumberContext<TRecord>* pNumber = static_cast<IdaDotShardNumberContext<TRecord>*>(pContext);
+  if (iDepth > 0 && pNumber->pFilters != nullptr && pNumber->pFilters->isSkipped(info.value))
+  {
+    return false;
+  }
+  while (!pNumber->open.empty() && pNumber->open.back().iMinDepth > iDepth)
+  {
+    pNumber->open.pop_back();
+  }
+
+  // A run continues the run of siblings before it, not the shard around both
+  const auto itRun = pNumber->pCuts->runs.find(&info);
+  if (itRun != pNumber->pCuts->runs.end())
+  {
+    pNumber->addShard(&info, true, iDepth, itRun->second);
+  }
+  const auto itCall = pNumber->pCuts->calls.find(&info);
+  if (itCall != pNumber->pCuts->calls.end())
+  {
+    pNumber->addShard(&info, false, iDepth + 1, itCall->second);
+  }
+
+  ++(*pNumber->pShards)[pNumber->open.empty() ? 0 : pNumber->open.back().iShard].iNodes;
+  return true;
+}
+
+// File name of a shard as it is linked from the other graphs, rendered with
+// "dot -Tsvg -O"
+inline std::string dotShardLink(const std::string& sPath)
+{
+  const size_t iSlash = sPath.find_last_of("/\\");
+  return (iSlash == std::string::npos ? sPath : sPath.substr(iSlash + 1)) + ".svg";
+}
+
+template<class TRecord>
+void writeDotShardLabel(OutputBuffer& output, const IdaDotShard<TRecord>& shard, SymbolLabels& labels)
+{
+  const CallTreeNode<TRecord>* pNode = shard.bContinued ? shard.pRoot->pParent : shard.pRoot;
+  if (pNode->pParent == nullptr)
+  {
+    output << "trace";
+  }
+  else
+  {
+    output << labels.get(pNode->value.getResultOther()).sDotLabel;
+  }
+  if (shard.bContinued)
+  {
+    output << " (continued)";
+  }
+}
+
+// Draws one shard. A cut call inside it gets a double border and links to
+// the graph of its subtree, the rest of a split run is one linked node.
+template<class TRecord>
+struct IdaDotShardPrinterContext
+{
+  IdaTreeDotPrinterContext<TRecord> dot;
+  size_t iShard = 0;
+  const IdaDotShardCuts<TRecord>* pCuts = nullptr;
+  const std::vector<IdaDotShard<TRecord>>* pShards = nullptr;
+  // Depth of the siblings continued in another shard, or -1
+  int iSkipDepth = -1;
+
+  void writeRunLink(int iDepth, size_t iRun)
+  {
+    OutputBuffer& output = *dot.pOutput;
+    const int iLinkDepth = std::min(iDepth, dot.iDepthPrev);
+    for (auto i = dot.iDepthPrev; i > iLinkDepth; --i)
+    {
+      output << indent(i - 1) << "}\n";
+    }
+
+    const IdaDotShard<TRecord>& run = (*pShards)[iRun];
+    output << indent(iLinkDepth) << "shard_" << iRun << "[label=\"";
+    writeDotShardLabel(output, run, dot.labels);
+    output << "\",shape=note,fillcolor=\"#ffffff\",URL=\"" << dotShardLink(run.sPath) << "\",];\n";
+    output << indent(iLinkDepth);
+    dot.writePrev();
+    output << " ->shard_" << iRun << ";\n";
+    dot.iDepthPrev = iLinkDepth;
+  }
+};
+
+template<class TRecord>
+bool treeDotShardPrinter(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  IdaDotShardPrinterContext<TRecord>* pPrinterContext = static_cast<IdaDotShardPrinterContext<TRecord>*>(pContext);
+  const IdaDotShard<TRecord>& shard = (*pPrinterContext->pShards)[pPrinterContext->iShard];
+
+  if (pPrinterContext->iSkipDepth >= 0)
+  {
+    if (iDepth >= pPrinterContext->iSkipDepth)
+    {
+      return false;
+    }
+    pPrinterContext->iSkipDepth = -1;
+  }
+
+  if (&info != shard.pRoot)
+  {
+    const auto itRun = pPrinterContext->pCuts->runs.find(&info);
+    if (itRun != pPrinterContext->pCuts->runs.end())
+    {
+      pPrinterContext->writeRunLink(iDepth, itRun->second);
+      pPrinterContext->iSkipDepth = iDepth;
+      return false;
+    }
+  }
+
+  if (!treeDotTextPrinter<TRecord>(info, iDepth, &pPrinterContext->dot))
+  {
+    return false;
+  }
+
+  if (&info == shard.pRoot && !shard.bContinued)
+  {
+    return true;
+  }
+  const auto itCall = pPrinterContext->pCuts->calls.find(&info);
+  if (itCall == pPrinterContext->pCuts->calls.end())
+  {
+    return true;
+  }
+
+  const IdaDotShard<TRecord>& call = (*pPrinterContext->pShards)[itCall->second];
+  *(pPrinterContext->dot.pOutput) << indent(iDepth) << "instr_" << static_cast<const void*>(&info)
+    << "[peripheries=2,URL=\"" << dotShardLink(call.sPath) << "\",];\n";
+  return false;
+}
+
+template<class TRecord>
+uint64_t writeDotShard(CallTree<TRecord>& tree, size_t iShard, const std::vector<IdaDotShard<TRecord>>& shards, const IdaDotShardCuts<TRecord>& cuts, const IdaTraceFilters* pFilters)
+{
+  const IdaDotShard<TRecord>& shard = shards[iShard];
+  std::ofstream fileOutput(shard.sPath);
+  OutputBuffer output(fileOutput.rdbuf());
+  IdaDotShardPrinterContext<TRecord> context;
+  context.dot.pOutput = &output;
+  context.dot.pFilters = pFilters;
+  context.iShard = iShard;
+  context.pCuts = &cuts;
+  context.pShards = &shards;
+  treeDotTextPrinterHeader<TRecord>(&context.dot);
+
+  if (!shard.bContinued)
+  {
+    tree.traverse(*shard.pRoot, &treeDotShardPrinter<TRecord>, context.dot.iDepthPrev, &context);
+  }
+  else
+  {
+    // The run ends where the next one begins
+    const int iDepth = context.dot.iDepthPrev;
+    for (CallTreeNode<TRecord>* pNode = shard.pRoot; ; pNode = &tree.node(pNode->iNextSibling))
+    {
+      const auto itRun = cuts.runs.find(pNode);
+      if (pNode != shard.pRoot && itRun != cuts.runs.end())
+      {
+        context.writeRunLink(iDepth, itRun->second);
+        break;
+      }
+      tree.traverse(*pNode, &treeDotShardPrinter<TRecord>, iDepth, &context);
+      if (pNode->iNextSibling == kNoCallTreeNode)
+      {
+        break;
+      }
+    }
+  }
+
+  treeDotTextPrinterFooter<TRecord>(&context.dot);
+  output.flush();
+  return output.size();
+}
+
+// Writes the graph of the tree as shards "<path>.<n>", the top of the tree in
+// shard 0, and an index graph of the shards to sPath
+template<class TRecord>
+IdaDotShardStats writeDotShards(CallTree<TRecord>& tree, const std::string& sPath, const IdaTraceFilters* pFilters, const IdaDotShardOptions& options)
+{
+  IdaDotShardPlanContext<TRecord> plan;
+  plan.pFilters = pFilters;
+  plan.options = options;
+  tree.traverse(&dotShardPlanner<TRecord>, 0, &plan);
+  plan.closeTo(0);
+
+  std::vector<IdaDotShard<TRecord>> shards(1);
+  shards[0].pRoot = &tree.root();
+  IdaDotShardNumberContext<TRecord> number;
+  number.pFilters = pFilters;
+  number.pCuts = &plan.cuts;
+  number.pShards = &shards;
+  tree.traverse(&dotShardNumberer<TRecord>, 0, &number);
+  for (size_t iShard = 0; iShard < shards.size(); ++iShard)
+  {
+    shards[iShard].sPath = sPath + "." + std::to_string(iShard);
+    // The root of a shard and its parent are printed by other shards as well
+    shards[iShard].pRoot->value.splitFields();
+    if (shards[iShard].pRoot->pParent != nullptr)
+    {
+      shards[iShard].pRoot->pParent->value.splitFields();
+    }
+  }
+
+  // The shards are independent, the tree is only read
+  std::vector<uint64_t> bytes(shards.size(), 0);
+  std::atomic<size_t> iNext(0);
+  const auto write = [&]()
+  {
+    for (size_t iShard = iNext++; iShard < shards.size(); iShard = iNext++)
+    {
+      bytes[iShard] = writeDotShard(tree, iShard, shards, plan.cuts, pFilters);
+    }
+  };
+
+  unsigned iWorkers = options.iWorkers == 0 ? std::max(1u, std::thread::hardware_concurrency()) : options.iWorkers;
+  iWorkers = static_cast<unsigned>(std::min<size_t>(iWorkers, shards.size()));
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < iWorkers; ++i)
+  {
+    workers.emplace_back(write);
+  }
+  write();
+  for (auto& worker : workers)
+  {
+    worker.join();
+  }
+
+  std::ofstream fileOutput(sPath);
+  OutputBuffer output(fileOutput.rdbuf());
+  output << "digraph {\n";
+  output << "  " << "node [shape=box style=filled];\n\n";
+  SymbolLabels labels;
+  for (size_t iShard = 0; iShard < shards.size(); ++iShard)
+  {
+    output << "  " << "shard_" << iShard << "[label=\"";
+    writeDotShardLabel(output, shards[iShard], labels);
+    output << "\\n" << shards[iShard].iNodes << " nodes\",URL=\"" << dotShardLink(shards[iShard].sPath) << "\",];\n";
+  }
+  output << '\n';
+  for (size_t iShard = 1; iShard < shards.size(); ++iShard)
+  {
+    output << "  " << "shard_" << shards[iShard].iParent << " -> shard_" << iShard << ";\n";
+  }
+  output << "}\n";
+  output.flush();
+
+  IdaDotShardStats stats;
+  stats.iShards = shards.size();
+  for (size_t iShard = 0; iShard < shards.size(); ++iShard)
+  {
+    stats.iNodes += shards[iShard].iNodes;
+    stats.iBytes += bytes[iShard];
+  }
+  stats.iBytes += output.size();
+  return stats;
+}
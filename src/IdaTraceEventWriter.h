@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "IdaCallStackBuilder.h"
+#include "IdaTraceFileRecord.h"
+#include "IdaTracePruner.h"
+#include "OutputBuffer.h"
+#include "SymbolLabels.h"
+#include "SymbolTable.h"
+
+// Quotes and escapes text as a JSON string
+inline void writeJsonString(OutputBuffer& output, std::string_view sText)
+{
+  static const char* const kHex = "0123456789abcdef";
+  output << '"';
+  size_t iPlain = 0;
+  for (size_t i = 0; i < sText.length(); ++i)
+  {
+    const unsigned char c = static_cast<unsigned char>(sText[i]);
+    if (c != '"' && c != '\\' && c >= 0x20)
+    {
+      continue;
+    }
+    output << sText.substr(iPlain, i - iPlain);
+    if (c == '"' || c == '\\')
+    {
+      output << '\\' << static_cast<char>(c);
+    }
+    else
+    {
+      output << "\\u00" << kHex[c >> 4] << kHex[c & 0xF];
+    }
+    iPlain = i + 1;
+  }
+  output << sText.substr(iPlain) << '"';
+}
+
+// Writes the calls of a trace as Chrome trace events, the JSON read by
+// Perfetto and chrome://tracing, while the records are read. Every traced
+// thread is a track with a call stack of its own; a call is a "B" event at
+// its row in the trace and an "E" event after the last row inside it, so
+// the timestamps are row numbers. Only the open calls are kept.
+template<class TRecord>
+class IdaTraceEventWriter
+{
+public:
+  IdaTraceEventWriter(OutputBuffer& output, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog)
+    : mOutput(output)
+    , mPrune(prune)
+    , mpRepairLog(pRepairLog)
+  {
+    mOutput << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  }
+
+  // Hands the next row of the trace to the call stack of its thread
+  void append(TRecord& record)
+  {
+    ++miTimestamp;
+    Track& track = getTrack(record.msThread);
+    if (mPrune.empty())
+    {
+      track.builder.append(record, track);
+    }
+    else
+    {
+      track.builder.append(record, track.pruner);
+    }
+  }
+
+  // Ends the calls still open and the document
+  void finish()
+  {
+    for (auto& track : mTracks)
+    {
+      closeTo(track, 1);
+    }
+    mOutput << "\n]}\n";
+  }
+
+  IdaCallStackStats stats() const
+  {
+    IdaCallStackStats result;
+    for (const auto& track : mTracks)
+    {
+      result += track.builder.stats();
+    }
+    return result;
+  }
+
+  uint64_t calls() const { return miCalls; }
+
+private:
+  struct Track
+  {
+    Track(IdaTraceEventWriter& writer, uint32_t iTid, SymbolId iThread)
+      : pWriter(&writer)
+      , iTid(iTid)
+      , iThread(iThread)
+      , pruner(writer.mPrune, *this)
+    {
+      builder.setRepairLog(writer.mpRepairLog);
+    }
+
+    // Sink of the builder
+    void operator()(TRecord& record, int iDepth)
+    {
+      pWriter->add(*this, record, iDepth);
+    }
+
+    IdaTraceEventWriter* pWriter;
+    const uint32_t iTid;
+    const SymbolId iThread;
+    // The name is written with the first call, threads without calls (like
+    // the header row) get no track
+    bool bNamed = false;
+    IdaCallStackBuilder<TRecord> builder;
+    IdaTracePruner<Track> pruner;
+    // Depths of the calls not ended yet
+    std::vector<int> openDepths;
+    // Row of the last record on this track
+    uint64_t iLastTimestamp = 0;
+  };
+
+  Track& getTrack(std::string_view sThread)
+  {
+    const SymbolId iThread = internSymbol(sThread);
+    auto itTrack = mTrackIndex.find(iThread);
+    if (itTrack == mTrackIndex.end())
+    {
+      const uint32_t iTid = static_cast<uint32_t>(mTracks.size() + 1);
+      itTrack = mTrackIndex.emplace(iThread, mTracks.size()).first;
+      mTracks.emplace_back(*this, iTid, iThread);
+    }
+    return mTracks[itTrack->second];
+  }
+
+  // Records arrive in pre-order, the calls at iDepth and below have ended
+  void add(Track& track, TRecord& record, int iDepth)
+  {
+    closeTo(track, iDepth);
+    track.iLastTimestamp = miTimestamp;
+    if (record.mInstruction_kind != IdaInstructionKind::Call)
+    {
+      return;
+    }
+
+    if (!track.bNamed)
+    {
+      beginEvent();
+      mOutput << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << track.iTid << ",\"name\":\"thread_name\",\"args\":{\"name\":";
+      writeJsonString(mOutput, symbolName(track.iThread));
+      mOutput << "}}";
+      track.bNamed = true;
+    }
+
+    // A call without a known callee is named after its operand
+    std::string_view sName = mLabels.get(record.getResultOther()).sName;
+    if (sName.empty())
+    {
+      sName = record.getInstructionOperands();
+      sName.remove_prefix(std::min(sName.length(), sName.find_first_not_of(' ')));
+    }
+    beginEvent();
+    mOutput << "{\"ph\":\"B\",\"pid\":1,\"tid\":" << track.iTid << ",\"ts\":" << miTimestamp << ",\"name\":";
+    writeJsonString(mOutput, sName);
+    mOutput << ",\"cat\":";
+    writeJsonString(mOutput, symbolName(record.getResultModule()));
+    mOutput << '}';
+    track.openDepths.push_back(iDepth);
+    ++miCalls;
+  }
+
+  void closeTo(Track& track, int iDepth)
+  {
+    while (!track.openDepths.empty() && track.openDepths.back() >= iDepth)
+    {
+      beginEvent();
+      mOutput << "{\"ph\":\"E\",\"pid\":1,\"tid\":" << track.iTid << ",\"ts\":" << track.iLastTimestamp + 1 << '}';
+      track.openDepths.pop_back();
+    }
+  }
+
+  void beginEvent()
+  {
+    if (mbFirstEvent)
+    {
+      mbFirstEvent = false;
+    }
+    else
+    {
+      mOutput << ",\n";
+    }
+  }
+
+  OutputBuffer& mOutput;
+  const IdaTracePruneOptions& mPrune;
+  IdaCallStackRepairLog* mpRepairLog;
+  SymbolLabels mLabels;
+
+  // Tracks live in a deque, their pruners point to them
+  std::deque<Track> mTracks;
+  std::unordered_map<SymbolId, size_t> mTrackIndex;
+
+  // Row number of the record being added
+  uint64_t miTimestamp = 0;
+  uint64_t miCalls = 0;
+  bool mbFirstEvent = true;
+};
@@ -1,25 +1,38 @@
 #pragma once
 
-#include <sstream>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <istream>
 #include <string>
+#include <string_view>
 #include <utility>
 
+#include "SymbolTable.h"
+
+// Instructions the call stack reconstruction tells apart
+enum class IdaInstructionKind : uint8_t
+{
+  Other,
+  Call,
+  Retn,
+  Bnd,
+};
+
+// Function, module and callee names are interned in globalSymbols(), the
+// records only keep their ids. Only what the call stack reconstruction needs
+// is split off when a record is made; the rest of the result is split on the
+// first call of an accessor that needs it and kept. Records printed on
+// several threads are split before they are shared (see splitFields).
 struct IdaTraceFileRecord
 {
   std::string msThread;
   std::string msAddress;
-  std::string msAddress_segment; //
-  std::string msAddress_func; //
-  std::string msAddress_shift; //
+  SymbolId miAddress_func = 0; //
   std::string msInstruction;
-  std::string msInstruction_name; //
-  std::string msInstruction_operands; //
+  IdaInstructionKind mInstruction_kind = IdaInstructionKind::Other; //
   std::string msResult;
-  std::string msResult_clean;
-  std::string msResult_func; //
-  std::string msResult_comment; //
-  std::string msResult_module; //
-  std::string msResult_other; //
+  SymbolId miResult_func = 0; //
 
   IdaTraceFileRecord() = default;
 
@@ -30,25 +43,47 @@ struct IdaTraceFileRecord
     , msResult(std::move(sResult))
   {
     splitAddress();
-    splitInstruction();
-    splitResult();
+    mInstruction_kind = getInstructionKind(getInstructionName());
+    miResult_func = internSymbol(std::string_view(msResult).substr(0, msResult.find(' ')));
+  }
+
+  static IdaInstructionKind getInstructionKind(std::string_view sInstruction_name)
+  {
+    if (sInstruction_name == "call")
+    {
+      return IdaInstructionKind::Call;
+    }
+    if (sInstruction_name == "retn")
+    {
+      return IdaInstructionKind::Retn;
+    }
+    if (sInstruction_name == "bnd")
+    {
+      return IdaInstructionKind::Bnd;
+    }
+    return IdaInstructionKind::Other;
   }
 
-  static size_t getFunctionOffsetPos(const std::string& in)
+  bool isReturn() const
+  {
+    return mInstruction_kind == IdaInstructionKind::Retn || mInstruction_kind == IdaInstructionKind::Bnd;
+  }
+
+  static size_t getFunctionOffsetPos(std::string_view in)
   {
     auto findPlus = in.rfind('+');
-    if (findPlus == std::string::npos)
+    if (findPlus == std::string_view::npos)
     {
       findPlus = 0;
     }
     auto findColon = in.rfind(':');
-    if (findColon == std::string::npos)
+    if (findColon == std::string_view::npos)
     {
       findColon = 0;
     }
     if (findColon == 0 && findPlus == 0)
     {
-      return std::string::npos;
+      return std::string_view::npos;
     }
     return std::max(findPlus, findColon);
   }
@@ -61,94 +96,227 @@ struct IdaTraceFileRecord
       return;
     }
 
-    if (msAddress.length() > 6 && msAddress.substr(0, 6) == ".text:")
+    const std::string_view sAddress = msAddress;
+    if (sAddress.length() > 6 && sAddress.substr(0, 6) == ".text:")
     {
-      msAddress_segment = ".text:";
-      msAddress_func = msAddress.substr(6, findMax - 6);
+      miAddress_func = internSymbol(sAddress.substr(6, findMax - 6));
     }
     else
     {
-      msAddress_func = msAddress.substr(0, findMax);
+      miAddress_func = internSymbol(sAddress.substr(0, findMax));
     }
+  }
 
-    msAddress_shift = msAddress.substr(findMax);
+  std::string_view getAddressSegment() const
+  {
+    const std::string_view sAddress = msAddress;
+    if (getFunctionOffsetPos(sAddress) == std::string_view::npos || sAddress.length() <= 6 || sAddress.substr(0, 6) != ".text:")
+    {
+      return std::string_view();
+    }
+    return sAddress.substr(0, 6);
   }
 
-  void splitInstruction()
+  std::string_view getAddressShift() const
   {
-    std::istringstream instr(msInstruction);
-    std::getline(instr, msInstruction_name, ' ');
-    std::getline(instr, msInstruction_operands);
+    const auto findMax = getFunctionOffsetPos(msAddress);
+    return findMax == std::string_view::npos ? std::string_view() : std::string_view(msAddress).substr(findMax);
   }
 
-  void splitResult()
+  std::string_view getInstructionName() const
   {
-    msResult_comment.clear();
-    msResult_other.clear();
+    return std::string_view(msInstruction).substr(0, msInstruction.find(' '));
+  }
 
-    std::istringstream instr(msResult);
-    std::getline(instr, msResult_func, ' ');
-    const size_t iMangled = msResult_func.length();
+  std::string_view getInstructionOperands() const
+  {
+    const size_t iSpace = msInstruction.find(' ');
+    return iSpace == std::string::npos ? std::string_view() : std::string_view(msInstruction).substr(iSpace + 1);
+  }
 
-    std::string curr;
-    bool bMangledFound = false;
-    while (std::getline(instr, curr, ' '))
+  const std::string& getResultComment() const
+  {
+    splitResult();
+    return msResult_comment;
+  }
+
+  SymbolId getResultModule() const
+  {
+    splitResult();
+    return miResult_module;
+  }
+
+  SymbolId getResultOther() const
+  {
+    splitResult();
+    return miResult_other;
+  }
+
+  // Splits what the accessors would split on first use
+  void splitFields() const
+  {
+    splitResult();
+  }
+
+  void splitResult() const
+  {
+    if (mbResultSplit)
+    {
+      return;
+    }
+    mbResultSplit = true;
+
+    std::string_view sComment;
+    std::string_view sOther;
+    const auto findSpace = [](std::string_view sField, size_t iFrom) { return sField.find(' ', iFrom); };
+    const bool bMangled = splitResultWords(msResult, findSpace, sComment, sOther);
+
+    msResult_comment = sComment;
+    msResult_clean.reserve(sComment.length() + 1 + sOther.length());
+    msResult_clean = msResult_comment;
+    msResult_clean += ' ';
+    if (bMangled)
+    {
+      forEachResultOtherPart(sOther, std::string_view(msResult).substr(0, msResult.find(' ')), [this](std::string_view sPart) { msResult_clean += sPart; });
+    }
+    else
+    {
+      msResult_clean += sOther;
+    }
+    splitResultOther(std::string_view(msResult_clean).substr(msResult_comment.length() + 1), isReturn(), miResult_module, miResult_other);
+  }
+
+  // Splits a result cell after its first word, the mangled name. The words
+  // after it are a comment up to the first word starting with the mangled
+  // name, the rest is the other part; both are contiguous in sResult. The
+  // comment starts at the first space, the other part after the mangled name
+  // of that word. Later words of the other part starting with the mangled
+  // name lose it and the space before it: true is returned when there are
+  // any, forEachResultOtherPart leaves them out then. findSpace(sField, iFrom)
+  // stands in for sField.find(' ', iFrom), e.g. to look the spaces up in the
+  // offsets of a TraceTokenCursor.
+  template<class TFindSpace>
+  static bool splitResultWords(std::string_view sResult, TFindSpace& findSpace, std::string_view& sComment, std::string_view& sOther)
+  {
+    sComment = std::string_view();
+    sOther = std::string_view();
+    const size_t iFirstSpace = findSpace(sResult, 0);
+    if (iFirstSpace == std::string_view::npos || iFirstSpace + 1 == sResult.length())
     {
-      if (curr.length() > iMangled
-        && curr.substr(0, iMangled) == msResult_func)
+      return false;
+    }
+
+    // A single trailing separator does not produce a word
+    size_t iEnd = sResult.length();
+    if (iEnd > iFirstSpace + 1 && sResult[iEnd - 1] == ' ')
+    {
+      --iEnd;
+    }
+
+    const std::string_view sMangled = sResult.substr(0, iFirstSpace);
+    size_t iMangledPos = std::string_view::npos;
+    bool bMangled = false;
+    for (size_t iWord = iFirstSpace + 1; iWord < iEnd; )
+    {
+      size_t iWordEnd = findSpace(sResult, iWord);
+      if (iWordEnd == std::string_view::npos || iWordEnd > iEnd)
       {
-        bMangledFound = true;
-        msResult_other += curr.substr(iMangled);
-        continue;
+        iWordEnd = iEnd;
       }
 
-      if (bMangledFound)
+      if (iWordEnd - iWord > sMangled.length()
+        && sResult.compare(iWord, sMangled.length(), sMangled) == 0)
       {
-        msResult_other += " " + curr;
+        if (iMangledPos == std::string_view::npos)
+        {
+          iMangledPos = iWord;
+        }
+        else
+        {
+          bMangled = true;
+          break;
+        }
       }
-      else
+
+      iWord = iWordEnd + 1;
+    }
+
+    if (iMangledPos == std::string_view::npos)
+    {
+      sComment = sResult.substr(iFirstSpace, iEnd - iFirstSpace);
+      return false;
+    }
+
+    sComment = sResult.substr(iFirstSpace, iMangledPos - 1 - iFirstSpace);
+    sOther = sResult.substr(iMangledPos + sMangled.length(), iEnd - iMangledPos - sMangled.length());
+    return bMangled;
+  }
+
+  // Calls callback with the pieces of an other part from splitResultWords
+  // between the later words starting with sMangled, which lose it and the
+  // space before it
+  template<class TCallback>
+  static void forEachResultOtherPart(std::string_view sOther, std::string_view sMangled, TCallback&& callback)
+  {
+    size_t iCopied = 0;
+    for (size_t iSpace = sOther.find(' '); iSpace != std::string_view::npos; iSpace = sOther.find(' ', iSpace + 1))
+    {
+      const size_t iWord = iSpace + 1;
+      size_t iWordEnd = sOther.find(' ', iWord);
+      if (iWordEnd == std::string_view::npos)
       {
-        msResult_comment += " " + curr;
+        iWordEnd = sOther.length();
       }
-    }
 
-    msResult_clean = msResult_comment + " " + msResult_other;
+      if (iWordEnd - iWord > sMangled.length()
+        && sOther.compare(iWord, sMangled.length(), sMangled) == 0)
+      {
+        callback(sOther.substr(iCopied, iSpace - iCopied));
+        iCopied = iWord + sMangled.length();
+      }
+    }
+    callback(sOther.substr(iCopied));
+  }
 
-    if (msInstruction_name == "retn" || msInstruction_name == "bnd")
+  // Splits the module off the other part of a result, a return also loses
+  // the offset it returns to
+  static void splitResultOther(std::string_view sOther, bool bReturn, SymbolId& iModule, SymbolId& iOther)
+  {
+    if (bReturn)
     {
-      msResult_other = msResult_other.substr(0, getFunctionOffsetPos(msResult_other));
+      sOther = sOther.substr(0, getFunctionOffsetPos(sOther));
     }
 
-    const size_t iColPos = msResult_other.find(':');
-    if (iColPos != std::string::npos)
+    const size_t iColPos = sOther.find(':');
+    if (iColPos != std::string_view::npos)
     {
-      const std::string begin = msResult_other.substr(0, 0 + iColPos);
-      if (begin != "public" && begin != "private" && begin != "protected" && begin.find(' ') == std::string::npos)
+      const std::string_view begin = sOther.substr(0, 0 + iColPos);
+      if (begin != "public" && begin != "private" && begin != "protected" && begin.find(' ') == std::string_view::npos)
       {
-        msResult_module = begin;
-        msResult_other = msResult_other.substr(iColPos + 1);
+        iModule = internSymbol(begin);
+        sOther = sOther.substr(iColPos + 1);
       }
     }
-
+    iOther = internSymbol(sOther);
   }
 
-  static std::string getFunctionNameOnly(const std::string& in)
+  static std::string_view getFunctionNameOnly(std::string_view in)
   {
     const size_t iBracket = in.find('(');
-    if (iBracket == std::string::npos)
+    if (iBracket == std::string_view::npos)
     {
       return in;
     }
 
-    std::string sBegin = in.substr(0, 0 + iBracket);
+    std::string_view sBegin = in.substr(0, 0 + iBracket);
 
     const size_t iSpace = sBegin.rfind(' ');
-    if (iSpace == std::string::npos)
+    if (iSpace == std::string_view::npos)
     {
       return sBegin;
     }
 
-    std::string sResult = sBegin.substr(iSpace);
+    std::string_view sResult = sBegin.substr(iSpace);
     
     //if (sResult.find('>') != std::string::npos)
     //{
@@ -158,7 +326,7 @@ struct IdaTraceFileRecord
     return sResult;
   }
 
-  static std::string getWithoutAccessKeyword(const std::string& in)
+  static std::string_view getWithoutAccessKeyword(std::string_view in)
   {
     const char sPublic[] = "public: ";
     constexpr size_t iPublic = sizeof(sPublic) - 1;
@@ -182,27 +350,32 @@ struct IdaTraceFileRecord
     return in;
   }
 
-  std::string getFunctionNameFromInstruction(bool bRemoveAccessKeyword = true)
+  std::string_view getFunctionNameFromInstruction(bool bRemoveAccessKeyword = true) const
+  {
+    return getFunctionNameFromInstruction(msInstruction, bRemoveAccessKeyword);
+  }
+
+  static std::string_view getFunctionNameFromInstruction(std::string_view sInstruction, bool bRemoveAccessKeyword)
   {
     const char sCall[] = "call    ";
     constexpr size_t iCall = sizeof(sCall) - 1;
     const char sCallImport[] = "call    cs:__declspec(dllimport) ";
     constexpr size_t iCallImport = sizeof(sCallImport) - 1;
 
-    if (msInstruction.length() <= iCall || msInstruction.substr(0, iCall) != sCall)
+    if (sInstruction.length() <= iCall || sInstruction.substr(0, iCall) != sCall)
     {
-      return msInstruction;
+      return sInstruction;
     }
 
-    std::string out;
+    std::string_view out;
 
-    if (msInstruction.length() > iCallImport && msInstruction.substr(0, iCallImport) == sCallImport)
+    if (sInstruction.length() > iCallImport && sInstruction.substr(0, iCallImport) == sCallImport)
     {
-      out = msInstruction.substr(iCallImport);
+      out = sInstruction.substr(iCallImport);
     }
     else
     {
-      out = msInstruction.substr(iCall);
+      out = sInstruction.substr(iCall);
     }
 
     if (bRemoveAccessKeyword)
@@ -213,26 +386,102 @@ struct IdaTraceFileRecord
     return out;
   }
 
-  static bool readLine(std::istream& stream, IdaTraceFileRecord& record, const char cSeparator = '\t')
+  // Calls callback with msResult_clean as consecutive pieces of text
+  template<class TCallback>
+  void forEachResultCleanPart(TCallback&& callback) const
   {
-    std::string sRow;
-    if (!std::getline(stream, sRow))
+    splitResult();
+    callback(std::string_view(msResult_clean));
+  }
+
+  const std::string& getResultClean() const
+  {
+    splitResult();
+    return msResult_clean;
+  }
+
+  // Result after the mangled name, before the retn/bnd offset and the module
+  // are cut off; it is kept joined, sJoined is not used
+  std::string_view getResultTail(std::string& /*sJoined*/) const
+  {
+    splitResult();
+    return std::string_view(msResult_clean).substr(msResult_comment.length() + 1);
+  }
+
+  // Bytes the strings of the record, the split ones included, hold on the
+  // heap; short strings are kept inside the std::string itself
+  size_t heapBytes() const
+  {
+    const std::string* const texts[] = { &msThread, &msAddress, &msInstruction, &msResult, &msResult_clean, &msResult_comment };
+    size_t iBytes = 0;
+    for (const std::string* pText : texts)
+    {
+      const char* pObject = reinterpret_cast<const char*>(pText);
+      if (pText->data() < pObject || pText->data() >= pObject + sizeof(std::string))
+      {
+        iBytes += pText->capacity() + 1;
+      }
+    }
+    return iBytes;
+  }
+
+  // Takes the next row from sInput and cuts it into its four cells without
+  // splitting the fields; a trailing '\r' is dropped.
+  static bool readCells(std::string_view& sInput, std::array<std::string_view, 4>& cells, const char cSeparator = '\t')
+  {
+    if (sInput.empty())
     {
       return false;
     }
 
-    std::istringstream row(sRow);
-    std::string cells[4];
+    const size_t iNewLine = sInput.find('\n');
+    std::string_view sRow = sInput.substr(0, iNewLine);
+    sInput.remove_prefix(iNewLine == std::string_view::npos ? sInput.length() : iNewLine + 1);
+    if (!sRow.empty() && sRow.back() == '\r')
+    {
+      sRow.remove_suffix(1);
+    }
+
+    size_t iPos = 0;
     for (auto& cell : cells)
     {
-      if (!std::getline(row, cell, cSeparator))
+      if (iPos >= sRow.length())
       {
         return false;
       }
+
+      const size_t iSeparator = sRow.find(cSeparator, iPos);
+      cell = sRow.substr(iPos, iSeparator == std::string_view::npos ? std::string_view::npos : iSeparator - iPos);
+      iPos = iSeparator == std::string_view::npos ? sRow.length() + 1 : iSeparator + 1;
+    }
+    return true;
+  }
+
+  // Rows are cut like the rows of a mapped trace, the cells are copied
+  static bool readLine(std::istream& stream, IdaTraceFileRecord& record, const char cSeparator = '\t')
+  {
+    std::string sRow;
+    if (!std::getline(stream, sRow))
+    {
+      return false;
+    }
+
+    std::string_view sInput = sRow;
+    std::array<std::string_view, 4> cells;
+    if (!readCells(sInput, cells, cSeparator))
+    {
+      return false;
     }
 
-    record = IdaTraceFileRecord(cells[0], cells[1], cells[2], cells[3]);
+    record = IdaTraceFileRecord(std::string(cells[0]), std::string(cells[1]), std::string(cells[2]), std::string(cells[3]));
     return true;
   }
 
+private:
+  // Split off msResult by splitResult
+  mutable bool mbResultSplit = false;
+  mutable std::string msResult_clean;
+  mutable std::string msResult_comment;
+  mutable SymbolId miResult_module = 0;
+  mutable SymbolId miResult_other = 0;
 };
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "MultiPatternMatcher.h"
+
+// Skip and column filter lists compiled into one MultiPatternMatcher, shared
+// by all printers. A record is skipped when its msResult contains a skip
+// pattern; it belongs to every column whose pattern is in its clean result.
+struct IdaTraceFilters
+{
+  static constexpr uint32_t kSkipGroup = 1;
+  static constexpr uint32_t kColumnGroup = 2;
+
+  std::vector<std::string> skipResult;
+  std::vector<std::string> columns;
+
+  MultiPatternMatcher matcher;
+
+  // Pattern ids: skip patterns first, then the columns in their order
+  void build()
+  {
+    matcher = MultiPatternMatcher();
+    for (const auto& filter : skipResult)
+    {
+      matcher.add(filter, kSkipGroup);
+    }
+    for (const auto& column : columns)
+    {
+      matcher.add(column, kColumnGroup);
+    }
+    matcher.build();
+  }
+
+  template<class TRecord>
+  bool isSkipped(const TRecord& record) const
+  {
+    return !skipResult.empty() && matcher.containsAny(record.msResult, kSkipGroup);
+  }
+
+  // Indices of the columns of a record in ascending order, found is scratch
+  // space kept by the caller
+  template<class TRecord>
+  void findColumns(const TRecord& record, std::vector<MultiPatternMatcher::PatternId>& found) const
+  {
+    found.clear();
+    if (columns.empty())
+    {
+      return;
+    }
+
+    MultiPatternMatcher::State state;
+    record.forEachResultCleanPart([this, &state, &found](std::string_view sPart) { matcher.collect(sPart, kColumnGroup, state, found); });
+
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    for (auto& iPattern : found)
+    {
+      iPattern -= static_cast<MultiPatternMatcher::PatternId>(skipResult.size());
+    }
+  }
+
+  // Non-empty lines of a filter file, "//" starts a comment line
+  static std::vector<std::string> loadFile(const std::string& sPath)
+  {
+    std::vector<std::string> filters;
+    std::ifstream file(sPath);
+    std::string sRow;
+    while (std::getline(file, sRow))
+    {
+      if (!sRow.empty() && sRow.substr(0, 2) != "//")
+      {
+        filters.push_back(sRow);
+      }
+    }
+    return filters;
+  }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// Shape of a synthetic trace
+struct IdaTraceGeneratorOptions
+{
+  uint64_t iRecords = 1000000;
+  int iMaxDepth = 16;
+  int iThreads = 1;
+  // Length of the plain function names, the mangled ones are 8 longer
+  int iNameLength = 16;
+  int iFunctions = 64;
+  // Shares of the records that are calls and returns, the rest are plain
+  // instructions
+  double fCallRatio = 0.15;
+  double fReturnRatio = 0.13;
+  // Share of the returns written as "bnd retn"
+  double fBndRatio = 0.1;
+  // Share of the returns that skip their caller, so the call stack has to be
+  // repaired
+  double fSkipRatio = 0.01;
+  uint64_t iSeed = 1;
+};
+
+// Writes IDA-style traces row by row. The same options and seed give the same
+// trace on every platform: only std::mt19937_64 is used, no distributions.
+class IdaTraceGenerator
+{
+public:
+  explicit IdaTraceGenerator(const IdaTraceGeneratorOptions& options)
+    : mOptions(options)
+    , mRandom(options.iSeed)
+  {
+    for (int i = 0; i < std::max(1, mOptions.iFunctions); ++i)
+    {
+      char sPrefix[16];
+      std::snprintf(sPrefix, sizeof(sPrefix), "fn%04X_", i);
+      std::string sName(sPrefix);
+      while (static_cast<int>(sName.length()) < mOptions.iNameLength)
+      {
+        sName += static_cast<char>('a' + next(26));
+      }
+      mFunctions.push_back(sName);
+    }
+
+    for (int i = 0; i < std::max(1, mOptions.iThreads); ++i)
+    {
+      char sThread[16];
+      std::snprintf(sThread, sizeof(sThread), "%08X", 0x1A2C + i * 0x104);
+      mThreads.push_back({ sThread, { "main" } });
+    }
+  }
+
+  // Appends the header row followed by all records
+  void generate(std::string& sOutput)
+  {
+    appendHeader(sOutput);
+    while (appendRecord(sOutput))
+    {
+    }
+  }
+
+  void appendHeader(std::string& sOutput)
+  {
+    sOutput += "Thread\tAddress\tInstruction\tResult\n";
+  }
+
+  // Appends one row, false once all records are written
+  bool appendRecord(std::string& sOutput)
+  {
+    if (miWritten == mOptions.iRecords)
+    {
+      return false;
+    }
+    ++miWritten;
+
+    // Threads run in slices of a few records
+    if (mThreads.size() > 1 && chance(0.1))
+    {
+      miThread = next(mThreads.size());
+    }
+    Thread& thread = mThreads[miThread];
+    std::vector<std::string>& stack = thread.stack;
+
+    const double fKind = unit();
+    if (fKind < mOptions.fCallRatio && static_cast<int>(stack.size()) <= mOptions.iMaxDepth)
+    {
+      const std::string& sCaller = stack.back();
+      const std::string& sCallee = mFunctions[next(mFunctions.size())];
+      static const char* const kModules[] = { "app.exe", "kernel32.dll", "ntdll.dll" };
+      static const char* const kAccess[] = { "", "public: ", "private: " };
+
+      appendAddress(sOutput, thread, sCaller);
+      sOutput += "call    ";
+      sOutput += sCallee;
+      sOutput += '\t';
+      appendMangled(sOutput, sCaller);
+      sOutput += " EAX=1 ";
+      appendMangled(sOutput, sCaller);
+      sOutput += kModules[next(3)];
+      sOutput += ':';
+      sOutput += kAccess[next(3)];
+      sOutput += "void __cdecl ";
+      sOutput += sCallee;
+      sOutput += "(int,char *)\n";
+
+      stack.push_back(sCallee);
+    }
+    else if (fKind < mOptions.fCallRatio + mOptions.fReturnRatio && stack.size() > 1)
+    {
+      const std::string sCallee = stack.back();
+      stack.pop_back();
+      if (stack.size() > 1 && chance(mOptions.fSkipRatio))
+      {
+        stack.pop_back();
+      }
+
+      appendAddress(sOutput, thread, sCallee);
+      sOutput += chance(mOptions.fBndRatio) ? "bnd retn\t" : "retn\t";
+      appendMangled(sOutput, sCallee);
+      sOutput += " ESP=0019FF70 ";
+      appendMangled(sOutput, sCallee);
+      sOutput += stack.back();
+      appendOffset(sOutput);
+      sOutput += '\n';
+    }
+    else
+    {
+      static const char* const kInstructions[] = { "mov     eax, [ebp+8]", "push    ebp", "xor     eax, eax", "lea     ecx, [esi+4]", "call    cs:__declspec(dllimport) public: int __cdecl Foo(void)" };
+
+      appendAddress(sOutput, thread, stack.back());
+      sOutput += kInstructions[next(5)];
+      sOutput += '\t';
+      appendMangled(sOutput, stack.back());
+      sOutput += " EAX=00000001 ZF=1\n";
+    }
+    return true;
+  }
+
+private:
+  struct Thread
+  {
+    std::string sId;
+    std::vector<std::string> stack;
+  };
+
+  uint64_t next(uint64_t iRange)
+  {
+    return mRandom() % iRange;
+  }
+
+  double unit()
+  {
+    return static_cast<double>(mRandom() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  bool chance(double fProbability)
+  {
+    return unit() < fProbability;
+  }
+
+  void appendOffset(std::string& sOutput)
+  {
+    char sOffset[16];
+    std::snprintf(sOffset, sizeof(sOffset), "+%X", static_cast<unsigned>(1 + next(0x400)));
+    sOutput += sOffset;
+  }
+
+  void appendAddress(std::string& sOutput, const Thread& thread, const std::string& sFunction)
+  {
+    sOutput += thread.sId;
+    sOutput += "\t.text:";
+    sOutput += sFunction;
+    appendOffset(sOutput);
+    sOutput += '\t';
+  }
+
+  static void appendMangled(std::string& sOutput, const std::string& sFunction)
+  {
+    sOutput += '?';
+    sOutput += sFunction;
+    sOutput += "@@YAXXZ";
+  }
+
+  IdaTraceGeneratorOptions mOptions;
+  std::mt19937_64 mRandom;
+  std::vector<std::string> mFunctions;
+  std::vector<Thread> mThreads;
+  size_t miThread = 0;
+  uint64_t miWritten = 0;
+};
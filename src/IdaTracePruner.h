@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+
+#include "CalleeNames.h"
+#include "IdaTraceFilters.h"
+#include "SymbolTable.h"
+
+// Records left out of the call tree while the trace is read
+struct IdaTracePruneOptions
+{
+  // Records skipped by the filters are dropped with their subtrees
+  const IdaTraceFilters* pFilters = nullptr;
+  // Deepest level kept below the root, 0 for all
+  int iMaxDepth = 0;
+  // Only the calls of this function are kept, as children of the root
+  std::string sRoot;
+
+  bool empty() const
+  {
+    return (pFilters == nullptr || pFilters->skipResult.empty()) && iMaxDepth <= 0 && sRoot.empty();
+  }
+};
+
+// Sink for IdaCallStackBuilder that hands only the kept records on to another
+// sink. Apart from the depth of a dropped subtree and of the selected call
+// nothing is remembered, the builder keeps the call stack of the whole trace.
+template<class TSink>
+class IdaTracePruner
+{
+public:
+  IdaTracePruner(const IdaTracePruneOptions& options, TSink& sink)
+    : mOptions(options)
+    , mSink(sink)
+    , miRoot(options.sRoot.empty() ? 0 : internSymbol(options.sRoot))
+  {
+  }
+
+  template<class TRecord>
+  void operator()(TRecord& record, int iDepth)
+  {
+    if (miSkipDepth >= 0)
+    {
+      if (iDepth > miSkipDepth)
+      {
+        return;
+      }
+      miSkipDepth = -1;
+    }
+
+    int iTreeDepth = iDepth;
+    if (miRoot != 0)
+    {
+      if (miRootDepth >= 0 && iDepth <= miRootDepth)
+      {
+        miRootDepth = -1;
+      }
+      if (miRootDepth < 0)
+      {
+        if (record.mInstruction_kind != IdaInstructionKind::Call || mCalleeNames.get(record) != miRoot)
+        {
+          return;
+        }
+        miRootDepth = iDepth;
+      }
+      iTreeDepth = iDepth - miRootDepth + 1;
+    }
+
+    if ((mOptions.iMaxDepth > 0 && iTreeDepth > mOptions.iMaxDepth)
+      || (mOptions.pFilters != nullptr && mOptions.pFilters->isSkipped(record)))
+    {
+      miSkipDepth = iDepth;
+      return;
+    }
+
+    mSink(record, iTreeDepth);
+  }
+
+private:
+  const IdaTracePruneOptions& mOptions;
+  TSink& mSink;
+  const SymbolId miRoot;
+  CalleeNames mCalleeNames;
+
+  // Depth of the record whose subtree is dropped, or -1
+  int miSkipDepth = -1;
+  // Depth of the selected call being kept, or -1
+  int miRootDepth = -1;
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+
+#include "IdaTraceFileRecord.h"
+#include "TraceTokenizer.h"
+
+// Same record as IdaTraceFileRecord, but every text field is a view into the
+// trace text (usually a MappedFile), so parsing a row does not allocate.
+// Splitting views is cheap, all fields are split when the record is made.
+struct IdaTraceRecordView
+{
+  std::string_view msThread;
+  std::string_view msAddress;
+  std::string_view msAddress_segment; //
+  SymbolId miAddress_func = 0; //
+  std::string_view msAddress_shift; //
+  std::string_view msInstruction;
+  std::string_view msInstruction_name; //
+  std::string_view msInstruction_operands; //
+  IdaInstructionKind mInstruction_kind = IdaInstructionKind::Other; //
+  std::string_view msResult;
+  SymbolId miResult_func = 0; //
+  std::string_view msResult_comment; //
+  SymbolId miResult_module = 0; //
+  SymbolId miResult_other = 0; //
+
+  // Result after the mangled name, before the retn/bnd offset and the module
+  // are cut off; msResult_clean of the owning record is msResult_comment + " " + msResult_tail
+  std::string_view msResult_tail;
+  // msResult_tail still holds later words starting with the mangled name,
+  // the accessors leave them out (see IdaTraceFileRecord::splitResultWords)
+  bool mbResult_tailMangled = false;
+
+  IdaTraceRecordView() = default;
+
+  IdaTraceRecordView(std::string_view sThread, std::string_view sAddress, std::string_view sInstruction, std::string_view sResult)
+    : IdaTraceRecordView(sThread, sAddress, sInstruction, sResult, [](std::string_view sField, size_t iFrom) { return sField.find(' ', iFrom); })
+  {
+  }
+
+  // findSpace(sField, iFrom) stands in for sField.find(' ', iFrom), e.g. to
+  // look the spaces up in the offsets of a TraceTokenCursor
+  template<class TFindSpace>
+  IdaTraceRecordView(std::string_view sThread, std::string_view sAddress, std::string_view sInstruction, std::string_view sResult, TFindSpace&& findSpace)
+    : msThread(sThread)
+    , msAddress(sAddress)
+    , msInstruction(sInstruction)
+    , msResult(sResult)
+  {
+    splitAddress();
+    splitInstruction(findSpace);
+    splitResult(findSpace);
+  }
+
+  void splitAddress()
+  {
+    const auto findMax = IdaTraceFileRecord::getFunctionOffsetPos(msAddress);
+    if (findMax == std::string_view::npos)
+    {
+      return;
+    }
+
+    if (msAddress.length() > 6 && msAddress.substr(0, 6) == ".text:")
+    {
+      msAddress_segment = msAddress.substr(0, 6);
+      miAddress_func = internSymbol(msAddress.substr(6, findMax - 6));
+    }
+    else
+    {
+      miAddress_func = internSymbol(msAddress.substr(0, findMax));
+    }
+
+    msAddress_shift = msAddress.substr(findMax);
+  }
+
+  template<class TFindSpace>
+  void splitInstruction(TFindSpace& findSpace)
+  {
+    const size_t iSpace = findSpace(msInstruction, 0);
+    msInstruction_name = msInstruction.substr(0, iSpace);
+    msInstruction_operands = iSpace == std::string_view::npos ? std::string_view() : msInstruction.substr(iSpace + 1);
+    mInstruction_kind = IdaTraceFileRecord::getInstructionKind(msInstruction_name);
+  }
+
+  // Split like IdaTraceFileRecord::splitResult. The comment and the tail are
+  // views into msResult; a tail with later mangled words is only joined to
+  // intern its other part, in a buffer kept by the thread.
+  template<class TFindSpace>
+  void splitResult(TFindSpace& findSpace)
+  {
+    miResult_func = internSymbol(msResult.substr(0, findSpace(msResult, 0)));
+
+    mbResult_tailMangled = IdaTraceFileRecord::splitResultWords(msResult, findSpace, msResult_comment, msResult_tail);
+    if (!mbResult_tailMangled)
+    {
+      IdaTraceFileRecord::splitResultOther(msResult_tail, isReturn(), miResult_module, miResult_other);
+      return;
+    }
+
+    thread_local std::string sJoined;
+    sJoined.clear();
+    forEachResultTailPart([](std::string_view sPart) { sJoined += sPart; });
+    IdaTraceFileRecord::splitResultOther(sJoined, isReturn(), miResult_module, miResult_other);
+  }
+
+  bool isReturn() const
+  {
+    return mInstruction_kind == IdaInstructionKind::Retn || mInstruction_kind == IdaInstructionKind::Bnd;
+  }
+
+  // The accessors of IdaTraceFileRecord
+  std::string_view getAddressSegment() const { return msAddress_segment; }
+  std::string_view getAddressShift() const { return msAddress_shift; }
+  std::string_view getInstructionName() const { return msInstruction_name; }
+  std::string_view getInstructionOperands() const { return msInstruction_operands; }
+  std::string_view getResultComment() const { return msResult_comment; }
+  SymbolId getResultModule() const { return miResult_module; }
+  SymbolId getResultOther() const { return miResult_other; }
+  void splitFields() const {}
+
+  std::string_view getFunctionNameFromInstruction(bool bRemoveAccessKeyword = true) const
+  {
+    return IdaTraceFileRecord::getFunctionNameFromInstruction(msInstruction, bRemoveAccessKeyword);
+  }
+
+  // Calls callback with the pieces of the tail, see mbResult_tailMangled
+  template<class TCallback>
+  void forEachResultTailPart(TCallback&& callback) const
+  {
+    if (!mbResult_tailMangled)
+    {
+      callback(msResult_tail);
+      return;
+    }
+    IdaTraceFileRecord::forEachResultOtherPart(msResult_tail, msResult.substr(0, msResult.find(' ')), callback);
+  }
+
+  // Calls callback with the clean result as consecutive pieces of text,
+  // without joining them
+  template<class TCallback>
+  void forEachResultCleanPart(TCallback&& callback) const
+  {
+    callback(msResult_comment);
+    callback(std::string_view(" "));
+    forEachResultTailPart(callback);
+  }
+
+  // The tail is only joined in sJoined when it has later mangled words
+  std::string_view getResultTail(std::string& sJoined) const
+  {
+    if (!mbResult_tailMangled)
+    {
+      return msResult_tail;
+    }
+    sJoined.clear();
+    forEachResultTailPart([&sJoined](std::string_view sPart) { sJoined += sPart; });
+    return sJoined;
+  }
+
+  std::string getResultClean() const
+  {
+    std::string sClean;
+    sClean.reserve(msResult_comment.length() + 1 + msResult_tail.length());
+    sClean += msResult_comment;
+    sClean += ' ';
+    forEachResultTailPart([&sClean](std::string_view sPart) { sClean += sPart; });
+    return sClean;
+  }
+
+  // See IdaTraceFileRecord::heapBytes. The text is in the trace the record
+  // was read from (a mapping or a block of it), dropping the record does not
+  // free any of it.
+  size_t heapBytes() const { return 0; }
+
+  // See IdaTraceFileRecord::readCells
+  static bool readCells(std::string_view& sInput, std::array<std::string_view, 4>& cells, const char cSeparator = '\t')
+  {
+    return IdaTraceFileRecord::readCells(sInput, cells, cSeparator);
+  }
+
+  // Takes the next row from sInput. Rows are split the same way as in
+  // IdaTraceFileRecord::readLine.
+  static bool readLine(std::string_view& sInput, IdaTraceRecordView& record, const char cSeparator = '\t')
+  {
+    std::array<std::string_view, 4> cells;
+    if (!readCells(sInput, cells, cSeparator))
+    {
+      return false;
+    }
+
+    record = IdaTraceRecordView(cells[0], cells[1], cells[2], cells[3]);
+    return true;
+  }
+
+  // Takes the next row of a tokenized block, the separators are not searched
+  // again
+  static bool readLine(TraceTokenCursor& cursor, IdaTraceRecordView& record)
+  {
+    std::array<std::string_view, 4> cells;
+    if (!cursor.readCells(cells))
+    {
+      return false;
+    }
+
+    record = IdaTraceRecordView(cells[0], cells[1], cells[2], cells[3],
+      [&cursor](std::string_view sField, size_t iFrom) { return cursor.findSpace(sField, iFrom); });
+    return true;
+  }
+};
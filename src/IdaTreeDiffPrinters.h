@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "CallTreeDiff.h"
+#include "IdaTreePrinters.h"
+#include "OutputBuffer.h"
+#include "SymbolLabels.h"
+#include "TraceCallTree.h"
+
+inline char diffMarker(CallTreeDiffKind kind)
+{
+  switch (kind)
+  {
+  case CallTreeDiffKind::Removed:
+    return '-';
+  case CallTreeDiffKind::Added:
+    return '+';
+  default:
+    return ' ';
+  }
+}
+
+// Writes the entries of CallTreeDiff indented like the text tree. Calls only
+// in the first trace start with '-', calls only in the second with '+',
+// the common calls leading to them with a space.
+struct IdaTreeDiffTextPrinter
+{
+  OutputBuffer* pOutput = nullptr;
+  SymbolLabels labels;
+
+  template<class TRecord>
+  void operator()(CallTreeDiffKind kind, const CallTreeNode<TRecord>& node, int iDepth, uint64_t iNodes)
+  {
+    *pOutput << diffMarker(kind) << ' ' << indent(iDepth - 1);
+    writeTabbedLabel(*pOutput, node.value, labels);
+    if (iNodes > 1)
+    {
+      *pOutput << " (" << iNodes << " nodes)";
+    }
+    *pOutput << '\n';
+  }
+};
+
+// Draws the entries of CallTreeDiff as a tree below "Begin": removed calls
+// are red, added ones green, the common calls leading to them grey
+template<class TRecord>
+struct IdaTreeDiffDotPrinter
+{
+  OutputBuffer* pOutput = nullptr;
+  SymbolLabels labels;
+
+  // Last node drawn at every depth, the parent of the next deeper one
+  std::vector<uint64_t> lastAtDepth{ 0 };
+  uint64_t iNodes = 0;
+
+  void begin()
+  {
+    *pOutput << "digraph {\n";
+    *pOutput << "  " << "graph [ranksep=\"0.15\"];\n";
+    *pOutput << "  " << "node [shape=box style=filled];\n\n";
+    *pOutput << "  " << "diff_0[label=\"Begin\"];\n";
+  }
+
+  void operator()(CallTreeDiffKind kind, const CallTreeNode<TRecord>& node, int iDepth, uint64_t iSubtreeNodes)
+  {
+    OutputBuffer& output = *pOutput;
+    const uint64_t iNode = ++iNodes;
+    output << "  " << "diff_" << iNode << "[label=\"" << diffMarker(kind) << ' ';
+    writeDotRecordLabel(output, node.value, labels);
+    if (iSubtreeNodes > 1)
+    {
+      output << "\\n" << iSubtreeNodes << " nodes";
+    }
+    output << "\",fillcolor=\"";
+    switch (kind)
+    {
+    case CallTreeDiffKind::Removed:
+      output << "#fbb4ae";
+      break;
+    case CallTreeDiffKind::Added:
+      output << "#ccebc5";
+      break;
+    default:
+      output << "#f2f2f2";
+      break;
+    }
+    output << "\",tooltip=\"";
+    writeDotRecordTooltip(output, node.value);
+    output << "\",];\n";
+    output << "  " << "diff_" << lastAtDepth[iDepth - 1] << " -> diff_" << iNode << ";\n";
+
+    lastAtDepth.resize(iDepth);
+    lastAtDepth.push_back(iNode);
+  }
+
+  void end()
+  {
+    *pOutput << "}\n";
+  }
+};
@@ -1,108 +1,267 @@
 #pragma once
 
-#include <ostream>
+#include <functional>
+#include <list>
+#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "IdaTraceFileRecord.h"
-#include "PrettyPrintUtils.h"
+#include "IdaTraceFilters.h"
+#include "OutputBuffer.h"
+#include "SymbolLabels.h"
+#include "SymbolTable.h"
 #include "TraceCallTree.h"
 
 // Printer
 struct IdaTreeTabbedPrinterContext
 {
-  std::ostream* pOutput = nullptr;
+  OutputBuffer* pOutput = nullptr;
   int iDepthPrev = 0;
-  std::vector<std::string> filterSkipResult;
+  const IdaTraceFilters* pFilters = nullptr;
+  SymbolLabels labels;
 };
 
-bool treeTabbedTextPrinter(CallTreeNode<IdaTraceFileRecord>& info, int iDepth, void* pContext)
+// Marks the calls of a subtree shared by CallTreeSharingAppender: the first
+// one shows "#k xN" and its children, the others only refer to it as "= #k".
+// The x is a multiplication sign in UTF-8.
+template<class TRecord>
+void writeSharedMark(OutputBuffer& output, const CallTreeNode<TRecord>& node)
 {
-  IdaTreeTabbedPrinterContext* pPrinterContext = static_cast<IdaTreeTabbedPrinterContext*>(pContext);
+  if (node.bSharedRef)
+  {
+    output << "= #" << node.iShared;
+  }
+  else
+  {
+    output << '#' << node.iShared << " \xC3\x97" << node.iRepeats;
+  }
+}
 
-  for (auto& filter : pPrinterContext->filterSkipResult)
+// A call shows the function it enters, anything else its own function
+template<class TRecord>
+void writeTabbedLabel(OutputBuffer& output, const TRecord& record, SymbolLabels& labels)
+{
+  if (record.mInstruction_kind == IdaInstructionKind::Call)
   {
-    if (info.value.msResult.find(filter) != std::string::npos)
-    {
-      return false;
-    }
+    output << symbolName(record.getResultModule()) << ':' << labels.get(record.getResultOther()).sName;
+  }
+  else
+  {
+    output << record.getFunctionNameFromInstruction()
+      // << " /* " << symbolName(record.miResult_other) << " */ "
+      ;
+  }
+}
+
+template<class TRecord>
+bool printTabbedRecord(const TRecord& record, int iDepth, IdaTreeTabbedPrinterContext* pPrinterContext, const CallTreeNode<TRecord>* pNode = nullptr)
+{
+  if (pPrinterContext->pFilters != nullptr && pPrinterContext->pFilters->isSkipped(record))
+  {
+    return false;
   }
 
   const auto iDepthDiff = iDepth - pPrinterContext->iDepthPrev;
   for (auto i = 0; i < iDepthDiff; ++i)
   {
-    *(pPrinterContext->pOutput) << ind(iDepth + i - 1) << "{" << std::endl;
+    *(pPrinterContext->pOutput) << indent(iDepth + i - 1) << "{\n";
   }
   for (auto i = iDepthDiff; i < 0; ++i)
   {
-    *(pPrinterContext->pOutput) << ind(pPrinterContext->iDepthPrev + iDepthDiff - i - 1) << "}" << std::endl;
+    *(pPrinterContext->pOutput) << indent(pPrinterContext->iDepthPrev + iDepthDiff - i - 1) << "}\n";
+  }
+
+  *(pPrinterContext->pOutput) << indent(iDepth);
+  writeTabbedLabel(*(pPrinterContext->pOutput), record, pPrinterContext->labels);
+  if (pNode != nullptr && pNode->iShared != 0)
+  {
+    *(pPrinterContext->pOutput) << " [";
+    writeSharedMark(*(pPrinterContext->pOutput), *pNode);
+    *(pPrinterContext->pOutput) << ']';
+  }
+  *(pPrinterContext->pOutput) << '\n';
+
+  pPrinterContext->iDepthPrev = iDepth;
+
+  return true;
+}
+
+template<class TRecord>
+bool treeTabbedTextPrinter(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  return printTabbedRecord(info.value, iDepth, static_cast<IdaTreeTabbedPrinterContext*>(pContext), &info);
+}
+
+// Starts a titled part of the output, e.g. the tree of one traced thread
+inline void treeTabbedTextPrinterSection(IdaTreeTabbedPrinterContext* pPrinterContext, std::string_view sTitle)
+{
+  for (auto i = pPrinterContext->iDepthPrev; i > 0; --i)
+  {
+    *(pPrinterContext->pOutput) << indent(i - 1) << "}\n";
   }
+  *(pPrinterContext->pOutput) << "thread " << sTitle << '\n';
+  pPrinterContext->iDepthPrev = 0;
+}
+
+// Printer for records coming straight from IdaCallStackBuilder: writes the
+// same text as treeTabbedTextPrinter without a CallTree in memory
+template<class TRecord>
+struct IdaTreeTabbedStreamPrinter
+{
+  IdaTreeTabbedPrinterContext context;
+
+  // Depth of a skipped record whose subtree is still being read, or -1
+  int iSkipDepth = -1;
+
+  // The root of the tree is an empty record
+  void begin()
+  {
+    if (!printTabbedRecord(TRecord(), 0, &context))
+    {
+      iSkipDepth = 0;
+    }
+  }
+
+  void operator()(const TRecord& record, int iDepth)
+  {
+    if (iSkipDepth >= 0)
+    {
+      if (iDepth > iSkipDepth)
+      {
+        return;
+      }
+      iSkipDepth = -1;
+    }
+
+    if (!printTabbedRecord(record, iDepth, &context))
+    {
+      iSkipDepth = iDepth;
+    }
+  }
+};
 
-  if (info.value.msInstruction_name == "call")
+inline void writeDotLabel(OutputBuffer& output, std::string_view sLabel)
+{
+  if (sLabel.length() > kDotLabelLength)
   {
-    *(pPrinterContext->pOutput) << ind(iDepth) << info.value.msResult_module << ":" << IdaTraceFileRecord::getWithoutAccessKeyword(info.value.msResult_other) << std::endl;
+    output << sLabel.substr(0, kDotLabelLength) << "...";
   }
   else
   {
-    *(pPrinterContext->pOutput) << ind(iDepth) << info.value.getFunctionNameFromInstruction()
-      // << " /* " << info.value.msResult_other << " */ "
-      << std::endl;
+    output << sLabel;
   }
+}
 
-  pPrinterContext->iDepthPrev = iDepth;
+// Clean result, address and instruction of a call
+template<class TRecord>
+void writeDotCallTooltip(OutputBuffer& output, const TRecord& record)
+{
+  record.forEachResultCleanPart([&output](std::string_view sPart) { output << sPart; });
+  output << "\\n\\n" << record.msAddress << "\\n\\n" << record.msInstruction;
+}
 
-  //*(pPrinterContext->pOutput) << ind(iDepth) << info.msAddress << "\t" << info.msInstruction << "\t" << info.msResult << endl; // TODO: Remove
-  return true;
+template<class TRecord>
+void writeDotRecordLabel(OutputBuffer& output, const TRecord& record, SymbolLabels& labels)
+{
+  if (record.mInstruction_kind == IdaInstructionKind::Call)
+  {
+    output << labels.get(record.getResultOther()).sDotLabel;
+  }
+  else
+  {
+    writeDotLabel(output, record.getFunctionNameFromInstruction());
+  }
+}
+
+template<class TRecord>
+void writeDotRecordTooltip(OutputBuffer& output, const TRecord& record)
+{
+  if (record.mInstruction_kind == IdaInstructionKind::Call)
+  {
+    writeDotCallTooltip(output, record);
+  }
+  else
+  {
+    output << record.msInstruction;
+  }
 }
 
 // Printer
+template<class TRecord>
 struct IdaTreeDotPrinterContext
 {
-  std::ostream* pOutput = nullptr;
+  OutputBuffer* pOutput = nullptr;
   int iDepthPrev = 0;
-  std::vector<std::string> filterSkipResult;
-  std::vector<std::string> filterColumns;
+  const IdaTraceFilters* pFilters = nullptr;
+  std::vector<MultiPatternMatcher::PatternId> foundColumns;
+  SymbolLabels labels;
 
-  std::map<std::string, std::list<CallTreeNode<IdaTraceFileRecord>*> > mapModuleNodes;
+  std::map<std::string, std::vector<CallTreeNode<TRecord>*>, std::less<>> mapModuleNodes;
 
-  std::string sPrev;
+  // Node the next one is linked from, nullptr for "Begin"
+  const CallTreeNode<TRecord>* pPrev = nullptr;
+  int iSections = 0;
+
+  // First calls of the shared subtrees drawn so far, by share number
+  std::vector<const CallTreeNode<TRecord>*> sharedNodes;
+
+  std::vector<CallTreeNode<TRecord>*>& moduleNodes(std::string_view sModule)
+  {
+    auto itModule = mapModuleNodes.find(sModule);
+    if (itModule == mapModuleNodes.end())
+    {
+      itModule = mapModuleNodes.emplace(std::string(sModule), std::vector<CallTreeNode<TRecord>*>()).first;
+    }
+    return itModule->second;
+  }
+
+  void writePrev()
+  {
+    if (pPrev == nullptr)
+    {
+      *pOutput << "Begin";
+    }
+    else
+    {
+      *pOutput << "instr_" << static_cast<const void*>(pPrev);
+    }
+  }
 };
 
-bool treeDotTextPrinter(CallTreeNode<IdaTraceFileRecord>& info, int iDepth, void* pContext)
+template<class TRecord>
+bool treeDotTextPrinter(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
 {
-  IdaTreeDotPrinterContext* pPrinterContext = static_cast<IdaTreeDotPrinterContext*>(pContext);
+  IdaTreeDotPrinterContext<TRecord>* pPrinterContext = static_cast<IdaTreeDotPrinterContext<TRecord>*>(pContext);
+  OutputBuffer& output = *(pPrinterContext->pOutput);
 
   // Remove unwanted
-  for (auto& filter : pPrinterContext->filterSkipResult)
+  if (pPrinterContext->pFilters != nullptr && pPrinterContext->pFilters->isSkipped(info.value))
   {
-    if (info.value.msResult.find(filter) != std::string::npos)
-    {
-      return false;
-    }
+    return false;
   }
 
   // Skip return
-  if (info.value.msInstruction_name == "retn")
+  if (info.value.mInstruction_kind == IdaInstructionKind::Retn)
   {
     return true;
   }
 
   // Add columns by user specified filters or module names
-  if (pPrinterContext->filterColumns.empty())
+  if (pPrinterContext->pFilters == nullptr || pPrinterContext->pFilters->columns.empty())
   {
-    if (!info.value.msResult_module.empty())
+    if (info.value.getResultModule() != 0)
     {
-      pPrinterContext->mapModuleNodes[info.value.msResult_module].push_back(&info);
+      pPrinterContext->moduleNodes(symbolName(info.value.getResultModule())).push_back(&info);
     }
   }
   else
   {
-    for (auto& filter : pPrinterContext->filterColumns)
+    pPrinterContext->pFilters->findColumns(info.value, pPrinterContext->foundColumns);
+    for (const auto iColumn : pPrinterContext->foundColumns)
     {
-      if (info.value.msResult_clean.find(filter) != std::string::npos)
-      {
-        pPrinterContext->mapModuleNodes[filter].push_back(&info);
-      }
+      pPrinterContext->moduleNodes(pPrinterContext->pFilters->columns[iColumn]).push_back(&info);
     }
   }
 
@@ -110,141 +269,166 @@ bool treeDotTextPrinter(CallTreeNode<IdaTraceFileRecord>& info, int iDepth, void
   const auto iDepthDiff = iDepth - pPrinterContext->iDepthPrev;
   for (auto i = 0; i < iDepthDiff; ++i)
   {
-    std::string sLabel = IdaTraceFileRecord::getFunctionNameOnly(info.pParent->value.msResult_other);
-    if (sLabel.length() > 50)
-    {
-      sLabel = sLabel.substr(0, 50) + "...";
-    }
-    *(pPrinterContext->pOutput) << ind(iDepth + i - 1) << "subgraph cluster_" << info.pParent << " {" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + i) << "label = \"" << sLabel << "\";" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + i) << "tooltip = \"" << info.pParent->value.msResult_other << "\";" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + i) << "style=filled;" << std::endl;
-
-    *(pPrinterContext->pOutput) << ind(iDepth + i) << "fillcolor = \"" << ((iDepth + i) % 7) + 1 << "\";" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + i) << "colorscheme=greys9;" << std::endl;
+    const SymbolLabel& parentLabel = pPrinterContext->labels.get(info.pParent->value.getResultOther());
+    output << indent(iDepth + i - 1) << "subgraph cluster_" << static_cast<const void*>(info.pParent) << " {\n";
+    output << indent(iDepth + i) << "label = \"" << parentLabel.sDotLabel << "\";\n";
+    output << indent(iDepth + i) << "tooltip = \"" << parentLabel.sTooltip << "\";\n";
+    output << indent(iDepth + i) << "style=filled;\n";
+
+    output << indent(iDepth + i) << "fillcolor = \"" << ((iDepth + i) % 7) + 1 << "\";\n";
+    output << indent(iDepth + i) << "colorscheme=greys9;\n";
   }
   for (auto i = iDepthDiff; i < 0; ++i)
   {
-    *(pPrinterContext->pOutput) << ind(pPrinterContext->iDepthPrev + iDepthDiff - i - 1) << "}" << std::endl;
+    output << indent(pPrinterContext->iDepthPrev + iDepthDiff - i - 1) << "}\n";
   }
 
-  // Define properties of node
-  const std::string sName = "instr_" + toStr(&info);
-  std::string sLabel;
-  std::string sTooltip;
-  std::string sColor = "#fed9a6";
-  if (!info.value.msResult_module.empty())
-  {
-    sColor = "#decbe4";
-  }
-  if (info.value.msInstruction_name == "call")
-  {
-    sTooltip = info.value.msResult_clean + "\\n\\n"
-      + info.value.msAddress + "\\n\\n"
-      + info.value.msInstruction;
-    sLabel = IdaTraceFileRecord::getFunctionNameOnly(info.value.msResult_other);
-  }
-  else
+  // Add node and edge
+  output << indent(iDepth) << "instr_" << static_cast<const void*>(&info) << "[label=\"";
+  writeDotRecordLabel(output, info.value, pPrinterContext->labels);
+  if (info.iShared != 0)
   {
-    sTooltip = info.value.msInstruction;
-    sLabel = info.value.getFunctionNameFromInstruction();
+    output << "\\n";
+    writeSharedMark(output, info);
   }
+  output << "\",fillcolor=\"" << (info.value.getResultModule() != 0 ? "#decbe4" : "#fed9a6") << "\",tooltip=\"";
+  writeDotRecordTooltip(output, info.value);
+  output << (info.bSharedRef ? "\",style=\"filled,dashed\",];\n" : "\",];\n");
 
-  if (sLabel.length() > 50)
+  output << indent(iDepth);
+  pPrinterContext->writePrev();
+  output << " ->instr_" << static_cast<const void*>(&info) << ";\n";
+
+  // A reference points to the subtree it shares when that is in this graph
+  if (info.iShared != 0)
   {
-    sLabel = sLabel.substr(0, 50) + "...";
+    auto& sharedNodes = pPrinterContext->sharedNodes;
+    if (sharedNodes.size() <= info.iShared)
+    {
+      sharedNodes.resize(static_cast<size_t>(info.iShared) + 1, nullptr);
+    }
+    if (!info.bSharedRef)
+    {
+      sharedNodes[info.iShared] = &info;
+    }
+    else if (sharedNodes[info.iShared] != nullptr)
+    {
+      output << indent(iDepth) << "instr_" << static_cast<const void*>(&info) << " -> instr_" << static_cast<const void*>(sharedNodes[info.iShared]) << " [style=dashed,constraint=false];\n";
+    }
   }
 
-  // Add node and edge
-  *(pPrinterContext->pOutput) << ind(iDepth) << sName << "["
-    << "label=\"" << sLabel << "\","
-    << "fillcolor=\"" << sColor << "\","
-    << "tooltip=\"" << sTooltip << "\","
-    << "];" << std::endl;
-  *(pPrinterContext->pOutput) << ind(iDepth) << pPrinterContext->sPrev << " ->" << sName << ";" << endl;
-
   // Store this record for future references
-  pPrinterContext->sPrev = sName;
+  pPrinterContext->pPrev = &info;
   pPrinterContext->iDepthPrev = iDepth;
 
   return true;
 }
 
+template<class TRecord>
 bool treeDotTextPrinterHeader(void* pContext)
 {
-  IdaTreeDotPrinterContext* pPrinterContext = static_cast<IdaTreeDotPrinterContext*>(pContext);
-  *(pPrinterContext->pOutput) << "digraph {" << endl;
-  *(pPrinterContext->pOutput) << "  " << "graph [newrank=true,ranksep=\"0.15\"];" << endl;
-  *(pPrinterContext->pOutput) << "  " << "node [newrank=true,shape=box style=filled];" << endl << endl;
+  IdaTreeDotPrinterContext<TRecord>* pPrinterContext = static_cast<IdaTreeDotPrinterContext<TRecord>*>(pContext);
+  OutputBuffer& output = *(pPrinterContext->pOutput);
+  output << "digraph {\n";
+  output << "  " << "graph [newrank=true,ranksep=\"0.15\"];\n";
+  output << "  " << "node [newrank=true,shape=box style=filled];\n\n";
 
-  *(pPrinterContext->pOutput) << "  " << "Begin[];" << endl << endl;
+  output << "  " << "Begin[];\n\n";
   ++pPrinterContext->iDepthPrev;
 
-  for (auto& col : pPrinterContext->filterColumns)
+  if (pPrinterContext->pFilters != nullptr)
   {
-    pPrinterContext->mapModuleNodes[col];
+    for (auto& col : pPrinterContext->pFilters->columns)
+    {
+      pPrinterContext->moduleNodes(col);
+    }
   }
 
   return true;
 }
 
+template<class TRecord>
 bool treeDotTextPrinterFooter(void* pContext)
 {
-  IdaTreeDotPrinterContext* pPrinterContext = static_cast<IdaTreeDotPrinterContext*>(pContext);
+  IdaTreeDotPrinterContext<TRecord>* pPrinterContext = static_cast<IdaTreeDotPrinterContext<TRecord>*>(pContext);
+  OutputBuffer& output = *(pPrinterContext->pOutput);
 
   for (auto i = pPrinterContext->iDepthPrev; i > 1; --i)
   {
-    *(pPrinterContext->pOutput) << ind(i) << "}" << std::endl;
+    output << indent(i) << "}\n";
   }
 
   int iDepth = 1;
   int iColor = 0;
 
-  *(pPrinterContext->pOutput) << ind(iDepth) << pPrinterContext->sPrev << "->" << "End;" << endl;
+  output << indent(iDepth);
+  pPrinterContext->writePrev();
+  output << "->End;\n";
 
   for (auto& moduleRec : pPrinterContext->mapModuleNodes)
   {
     iColor = iColor % 9 + 1;
+    const void* pModule = &moduleRec.first;
 
-    *(pPrinterContext->pOutput) << ind(iDepth) << "subgraph cluster_" << &moduleRec.first << " {" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + 1) << "label = \"" << moduleRec.first << "\";" << std::endl;
-    //*(pPrinterContext->pOutput) << ind(iDepth + 1) << "tooltip = \"" << info.pParent->value.msResult_other << "\";" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + 1) << "style=filled;" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + 1) << "fillcolor = \"" << iColor << "\";" << std::endl;
-    *(pPrinterContext->pOutput) << ind(iDepth + 1) << "colorscheme=bugn9;" << std::endl;
+    output << indent(iDepth) << "subgraph cluster_" << pModule << " {\n";
+    output << indent(iDepth + 1) << "label = \"" << moduleRec.first << "\";\n";
+    //output << indent(iDepth + 1) << "tooltip = \"" << symbolName(info.pParent->value.getResultOther()) << "\";\n";
+    output << indent(iDepth + 1) << "style=filled;\n";
+    output << indent(iDepth + 1) << "fillcolor = \"" << iColor << "\";\n";
+    output << indent(iDepth + 1) << "colorscheme=bugn9;\n";
 
-    *(pPrinterContext->pOutput) << ind(iDepth + 1) << "firtsFor_" << &moduleRec.first << "[style=invis];" << std::endl;
+    output << indent(iDepth + 1) << "firtsFor_" << pModule << "[style=invis];\n";
 
     for (auto& node : moduleRec.second)
     {
-      std::string sLabel;
-      std::string sTooltip;
-
-      sTooltip = node->value.msResult_clean + "\\n\\n"
-        + node->value.msAddress + "\\n\\n"
-        + node->value.msInstruction;
-      sLabel = IdaTraceFileRecord::getFunctionNameOnly(node->value.msResult_other);
-      if (sLabel.length() > 50)
-      {
-        sLabel = sLabel.substr(0, 50) + "...";
-      }
-
-      *(pPrinterContext->pOutput) << ind(iDepth + 1) << "extern_" << node << "["
-        << "label=\"" << sLabel << "\","
-        << "tooltip=\"" << sTooltip << "\","
-        << "];" << std::endl;
+      output << indent(iDepth + 1) << "extern_" << static_cast<const void*>(node) << "[label=\"";
+      output << pPrinterContext->labels.get(node->value.getResultOther()).sDotLabel;
+      output << "\",tooltip=\"";
+      writeDotCallTooltip(output, node->value);
+      output << "\",];\n";
     }
 
-    *(pPrinterContext->pOutput) << ind(iDepth) << "}" << std::endl;
+    output << indent(iDepth) << "}\n";
 
     for (auto& node : moduleRec.second)
     {
-      *(pPrinterContext->pOutput) << ind(iDepth) << "{rank=same;" << "extern_" << node << ";" << "instr_" << node << "};" << endl;
+      output << indent(iDepth) << "{rank=same;extern_" << static_cast<const void*>(node) << ";instr_" << static_cast<const void*>(node) << "};\n";
     }
-    *(pPrinterContext->pOutput) << ind(iDepth) << "{rank=min;" << "firtsFor_" << &moduleRec.first << "};" << endl;
+    output << indent(iDepth) << "{rank=min;firtsFor_" << pModule << "};\n";
   }
 
-  *(pPrinterContext->pOutput) << "}" << std::endl;
+  output << "}\n";
+
+  return true;
+}
+
+// Puts the nodes printed until treeDotTextPrinterSectionEnd into a cluster
+template<class TRecord>
+bool treeDotTextPrinterSectionBegin(void* pContext, std::string_view sTitle)
+{
+  IdaTreeDotPrinterContext<TRecord>* pPrinterContext = static_cast<IdaTreeDotPrinterContext<TRecord>*>(pContext);
+  OutputBuffer& output = *(pPrinterContext->pOutput);
+
+  output << indent(1) << "subgraph cluster_section_" << pPrinterContext->iSections++ << " {\n";
+  output << indent(2) << "label = \"thread " << sTitle << "\";\n";
+  output << indent(2) << "style=dashed;\n";
+  pPrinterContext->pPrev = nullptr;
+  ++pPrinterContext->iDepthPrev;
+
+  return true;
+}
+
+template<class TRecord>
+bool treeDotTextPrinterSectionEnd(void* pContext)
+{
+  IdaTreeDotPrinterContext<TRecord>* pPrinterContext = static_cast<IdaTreeDotPrinterContext<TRecord>*>(pContext);
+
+  for (auto i = pPrinterContext->iDepthPrev; i > 2; --i)
+  {
+    *(pPrinterContext->pOutput) << indent(i) << "}\n";
+  }
+  *(pPrinterContext->pOutput) << indent(1) << "}\n";
+  pPrinterContext->iDepthPrev = 1;
 
   return true;
 }
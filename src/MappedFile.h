@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+  MappedFile() = default;
+
+  explicit MappedFile(const std::string& sPath)
+  {
+    open(sPath);
+  }
+
+  ~MappedFile()
+  {
+    close();
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool open(const std::string& sPath)
+  {
+    close();
+
+#ifdef _WIN32
+    mhFile = CreateFileA(sPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (mhFile == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+
+    LARGE_INTEGER iFileSize;
+    if (!GetFileSizeEx(mhFile, &iFileSize))
+    {
+      close();
+      return false;
+    }
+    miSize = static_cast<size_t>(iFileSize.QuadPart);
+    mbOpen = true;
+    if (miSize == 0)
+    {
+      return true;
+    }
+
+    mhMapping = CreateFileMappingA(mhFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mhMapping == nullptr)
+    {
+      close();
+      return false;
+    }
+
+    mpData = static_cast<const char*>(MapViewOfFile(mhMapping, FILE_MAP_READ, 0, 0, 0));
+    if (mpData == nullptr)
+    {
+      close();
+      return false;
+    }
+#else
+    miFile = ::open(sPath.c_str(), O_RDONLY);
+    if (miFile < 0)
+    {
+      return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(miFile, &fileStat) != 0)
+    {
+      close();
+      return false;
+    }
+    miSize = static_cast<size_t>(fileStat.st_size);
+    mbOpen = true;
+    if (miSize == 0)
+    {
+      return true;
+    }
+
+    void* pMapping = mmap(nullptr, miSize, PROT_READ, MAP_PRIVATE, miFile, 0);
+    if (pMapping == MAP_FAILED)
+    {
+      close();
+      return false;
+    }
+    madvise(pMapping, miSize, MADV_SEQUENTIAL);
+    mpData = static_cast<const char*>(pMapping);
+#endif
+
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if (mpData != nullptr)
+    {
+      UnmapViewOfFile(mpData);
+    }
+    if (mhMapping != nullptr)
+    {
+      CloseHandle(mhMapping);
+      mhMapping = nullptr;
+    }
+    if (mhFile != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(mhFile);
+      mhFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (mpData != nullptr)
+    {
+      munmap(const_cast<char*>(mpData), miSize);
+    }
+    if (miFile >= 0)
+    {
+      ::close(miFile);
+      miFile = -1;
+    }
+#endif
+    mpData = nullptr;
+    miSize = 0;
+    mbOpen = false;
+  }
+
+  bool isOpen() const { return mbOpen; }
+  const char* data() const { return mpData; }
+  size_t size() const { return miSize; }
+  std::string_view view() const { return std::string_view(mpData, miSize); }
+
+private:
+  const char* mpData = nullptr;
+  size_t miSize = 0;
+  bool mbOpen = false;
+
+#ifdef _WIN32
+  HANDLE mhFile = INVALID_HANDLE_VALUE;
+  HANDLE mhMapping = nullptr;
+#else
+  int miFile = -1;
+#endif
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Aho-Corasick automaton: finds any number of substrings in one pass over
+// the text. Every pattern belongs to a group (a bit of a mask), so one
+// automaton can serve several filter lists, and a scan only reports the
+// groups it asks for. Characters that occur in no pattern share one column
+// of the transition table.
+class MultiPatternMatcher
+{
+public:
+  using PatternId = uint32_t;
+
+  // Patterns are numbered in the order they are added
+  PatternId add(std::string_view sPattern, uint32_t iGroup)
+  {
+    mPatterns.emplace_back(sPattern);
+    mPatternGroups.push_back(iGroup);
+    mbBuilt = false;
+    return static_cast<PatternId>(mPatterns.size() - 1);
+  }
+
+  size_t size() const { return mPatterns.size(); }
+
+  void build()
+  {
+    // Character classes
+    for (auto& iClass : mClassOf)
+    {
+      iClass = 0;
+    }
+    miClasses = 1;
+    for (const auto& sPattern : mPatterns)
+    {
+      for (const unsigned char c : sPattern)
+      {
+        if (mClassOf[c] == 0)
+        {
+          mClassOf[c] = static_cast<uint16_t>(miClasses++);
+        }
+      }
+    }
+
+    // Trie
+    mNext.assign(miClasses, kNone);
+    std::vector<std::vector<PatternId>> outputs(1);
+    for (PatternId iPattern = 0; iPattern < mPatterns.size(); ++iPattern)
+    {
+      uint32_t iNode = 0;
+      for (const unsigned char c : mPatterns[iPattern])
+      {
+        uint32_t& iChild = mNext[iNode * miClasses + mClassOf[c]];
+        if (iChild == kNone)
+        {
+          iChild = static_cast<uint32_t>(outputs.size());
+          outputs.emplace_back();
+          mNext.resize(mNext.size() + miClasses, kNone);
+        }
+        iNode = mNext[iNode * miClasses + mClassOf[c]];
+      }
+      outputs[iNode].push_back(iPattern);
+    }
+
+    const size_t iNodes = outputs.size();
+    std::vector<uint32_t> fail(iNodes, 0);
+    mOutputLink.assign(iNodes, kNone);
+    mGroupMask.assign(iNodes, 0);
+    for (size_t iNode = 0; iNode < iNodes; ++iNode)
+    {
+      for (const auto iPattern : outputs[iNode])
+      {
+        mGroupMask[iNode] |= mPatternGroups[iPattern];
+      }
+    }
+
+    // Failure links in breadth-first order turn the trie into a full automaton
+    std::queue<uint32_t> queue;
+    for (uint32_t iClass = 0; iClass < miClasses; ++iClass)
+    {
+      uint32_t& iChild = mNext[iClass];
+      if (iChild == kNone)
+      {
+        iChild = 0;
+      }
+      else
+      {
+        queue.push(iChild);
+      }
+    }
+    while (!queue.empty())
+    {
+      const uint32_t iNode = queue.front();
+      queue.pop();
+
+      const uint32_t iFail = fail[iNode];
+      mOutputLink[iNode] = outputs[iFail].empty() ? mOutputLink[iFail] : iFail;
+      mGroupMask[iNode] |= mGroupMask[iFail];
+
+      for (uint32_t iClass = 0; iClass < miClasses; ++iClass)
+      {
+        uint32_t& iChild = mNext[iNode * miClasses + iClass];
+        if (iChild == kNone)
+        {
+          iChild = mNext[iFail * miClasses + iClass];
+        }
+        else
+        {
+          fail[iChild] = mNext[iFail * miClasses + iClass];
+          queue.push(iChild);
+        }
+      }
+    }
+
+    // Flatten the own outputs of the nodes
+    mOutputBegin.assign(iNodes + 1, 0);
+    mOutputs.clear();
+    for (size_t iNode = 0; iNode < iNodes; ++iNode)
+    {
+      mOutputBegin[iNode] = static_cast<uint32_t>(mOutputs.size());
+      mOutputs.insert(mOutputs.end(), outputs[iNode].begin(), outputs[iNode].end());
+    }
+    mOutputBegin[iNodes] = static_cast<uint32_t>(mOutputs.size());
+
+    mbBuilt = true;
+  }
+
+  bool isBuilt() const { return mbBuilt; }
+
+  // Scan position, so a text given in several parts is matched as a whole
+  struct State
+  {
+    uint32_t iNode = 0;
+  };
+
+  // Whether the text contains a pattern of the groups; stops at the first one
+  bool containsAny(std::string_view sText, uint32_t iGroups, State& state) const
+  {
+    // The empty pattern matches before the first character
+    if (mGroupMask[state.iNode] & iGroups)
+    {
+      return true;
+    }
+    for (const unsigned char c : sText)
+    {
+      state.iNode = mNext[state.iNode * miClasses + mClassOf[c]];
+      if (mGroupMask[state.iNode] & iGroups)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool containsAny(std::string_view sText, uint32_t iGroups) const
+  {
+    State state;
+    return containsAny(sText, iGroups, state);
+  }
+
+  // Appends the ids of the patterns of the groups found in the text; a
+  // pattern is appended once per occurrence
+  void collect(std::string_view sText, uint32_t iGroups, State& state, std::vector<PatternId>& found) const
+  {
+    if (state.iNode == 0)
+    {
+      collectAt(0, iGroups, found);
+    }
+    for (const unsigned char c : sText)
+    {
+      state.iNode = mNext[state.iNode * miClasses + mClassOf[c]];
+      if (mGroupMask[state.iNode] & iGroups)
+      {
+        collectAt(state.iNode, iGroups, found);
+      }
+    }
+  }
+
+private:
+  static constexpr uint32_t kNone = ~uint32_t(0);
+
+  void collectAt(uint32_t iNode, uint32_t iGroups, std::vector<PatternId>& found) const
+  {
+    for (; iNode != kNone; iNode = mOutputLink[iNode])
+    {
+      for (uint32_t i = mOutputBegin[iNode]; i < mOutputBegin[iNode + 1]; ++i)
+      {
+        if (mPatternGroups[mOutputs[i]] & iGroups)
+        {
+          found.push_back(mOutputs[i]);
+        }
+      }
+    }
+  }
+
+  std::vector<std::string> mPatterns;
+  std::vector<uint32_t> mPatternGroups;
+  bool mbBuilt = false;
+
+  uint16_t mClassOf[256] = {};
+  uint32_t miClasses = 1;
+  std::vector<uint32_t> mNext;
+
+  std::vector<uint32_t> mOutputLink;
+  std::vector<uint32_t> mGroupMask;
+  std::vector<uint32_t> mOutputBegin;
+  std::vector<PatternId> mOutputs;
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Output of the printers. Text collects in one large buffer that is handed to
+// the target stream buffer only when full and on flush(), never per line.
+// Indentation and numbers are formatted in place, so writing a line does not
+// allocate.
+class OutputBuffer
+{
+public:
+  // Indentation of two characters per level, see indent()
+  struct Indent
+  {
+    int iLevel;
+  };
+
+  explicit OutputBuffer(std::streambuf* pTarget = nullptr, size_t iCapacity = 1 << 20)
+    : mpTarget(pTarget)
+    , mBuffer(iCapacity)
+  {
+  }
+
+  ~OutputBuffer()
+  {
+    flush();
+  }
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  void setTarget(std::streambuf* pTarget)
+  {
+    flush();
+    mpTarget = pTarget;
+  }
+
+  // Hands the buffered text to the target
+  void flush()
+  {
+    if (miUsed != 0 && mpTarget != nullptr)
+    {
+      mpTarget->sputn(mBuffer.data(), static_cast<std::streamsize>(miUsed));
+    }
+    miFlushed += miUsed;
+    miUsed = 0;
+  }
+
+  // Bytes written so far, flushed or not
+  uint64_t size() const { return miFlushed + miUsed; }
+
+  OutputBuffer& operator<<(std::string_view sText)
+  {
+    // An empty view may have no data, memcpy must not see it
+    if (sText.empty())
+    {
+      return *this;
+    }
+    if (sText.length() > mBuffer.size() - miUsed)
+    {
+      flush();
+      if (sText.length() > mBuffer.size())
+      {
+        if (mpTarget != nullptr)
+        {
+          mpTarget->sputn(sText.data(), static_cast<std::streamsize>(sText.length()));
+        }
+        miFlushed += sText.length();
+        return *this;
+      }
+    }
+    std::memcpy(mBuffer.data() + miUsed, sText.data(), sText.length());
+    miUsed += sText.length();
+    return *this;
+  }
+
+  // Without it a literal would print as a pointer
+  OutputBuffer& operator<<(const char* sText)
+  {
+    return *this << std::string_view(sText);
+  }
+
+  OutputBuffer& operator<<(char c)
+  {
+    reserve(1);
+    mBuffer[miUsed++] = c;
+    return *this;
+  }
+
+  template<class T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value, int> = 0>
+  OutputBuffer& operator<<(T iValue)
+  {
+    char digits[24];
+    char* pEnd = digits + sizeof(digits);
+    char* pBegin = pEnd;
+    // Negating in the unsigned type also works for the lowest value
+    using TUnsigned = std::make_unsigned_t<T>;
+    TUnsigned iMagnitude = iValue < 0 ? TUnsigned(0) - static_cast<TUnsigned>(iValue) : static_cast<TUnsigned>(iValue);
+    do
+    {
+      *--pBegin = static_cast<char>('0' + iMagnitude % 10);
+      iMagnitude /= 10;
+    } while (iMagnitude != 0);
+    if (iValue < 0)
+    {
+      *--pBegin = '-';
+    }
+    return *this << std::string_view(pBegin, static_cast<size_t>(pEnd - pBegin));
+  }
+
+  // Same text as std::ostream writes for a pointer with libstdc++: 0x and
+  // lowercase hex digits, 0 for nullptr
+  OutputBuffer& operator<<(const void* pValue)
+  {
+    if (pValue == nullptr)
+    {
+      return *this << '0';
+    }
+
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    char digits[2 + 2 * sizeof(void*)];
+    char* pEnd = digits + sizeof(digits);
+    char* pBegin = pEnd;
+    uintptr_t iValue = reinterpret_cast<uintptr_t>(pValue);
+    do
+    {
+      *--pBegin = kHexDigits[iValue & 0xf];
+      iValue >>= 4;
+    } while (iValue != 0);
+    *--pBegin = 'x';
+    *--pBegin = '0';
+    return *this << std::string_view(pBegin, static_cast<size_t>(pEnd - pBegin));
+  }
+
+  // Two spaces per level, or two underscores per level below zero
+  OutputBuffer& operator<<(Indent indent)
+  {
+    static const std::string_view sSpaces(kSpaces, sizeof(kSpaces) - 1);
+    static const std::string_view sUnderscores(kUnderscores, sizeof(kUnderscores) - 1);
+    const std::string_view sFill = indent.iLevel < 0 ? sUnderscores : sSpaces;
+    size_t iLength = static_cast<size_t>(indent.iLevel < 0 ? -indent.iLevel : indent.iLevel) * 2;
+    while (iLength > 0)
+    {
+      const size_t iPart = iLength < sFill.length() ? iLength : sFill.length();
+      *this << sFill.substr(0, iPart);
+      iLength -= iPart;
+    }
+    return *this;
+  }
+
+private:
+  static constexpr char kSpaces[] = "                                                                                                                                ";
+  static constexpr char kUnderscores[] = "________________________________________________________________________________________________________________________________";
+
+  void reserve(size_t iLength)
+  {
+    if (iLength > mBuffer.size() - miUsed)
+    {
+      flush();
+    }
+  }
+
+  std::streambuf* mpTarget = nullptr;
+  std::vector<char> mBuffer;
+  size_t miUsed = 0;
+  uint64_t miFlushed = 0;
+};
+
+inline OutputBuffer::Indent indent(int iLevel)
+{
+  return OutputBuffer::Indent{ iLevel };
+}
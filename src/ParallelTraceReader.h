@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "IdaTraceRecordView.h"
+#include "TraceTokenizer.h"
+
+// Parses a mapped trace on a pool of workers. The input is cut into chunks at
+// line boundaries, the workers tokenize and split the rows of a chunk into
+// IdaTraceRecordView records, and readLine hands them out in file order, so
+// the order-dependent call stack reconstruction stays sequential.
+// Only a bounded window of chunks is parsed ahead of the reader.
+class ParallelTraceReader
+{
+public:
+  ParallelTraceReader(std::string_view sInput, unsigned iThreads, size_t iChunkSize = 4 << 20)
+  {
+    if (iThreads == 0)
+    {
+      iThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Chunk boundaries, each chunk ends right after a new line
+    size_t iBegin = 0;
+    while (iBegin < sInput.length())
+    {
+      size_t iEnd = sInput.length();
+      if (iBegin + iChunkSize < sInput.length())
+      {
+        const size_t iNewLine = sInput.find('\n', iBegin + iChunkSize);
+        if (iNewLine != std::string_view::npos)
+        {
+          iEnd = iNewLine + 1;
+        }
+      }
+      mChunkInputs.push_back(sInput.substr(iBegin, iEnd - iBegin));
+      iBegin = iEnd;
+    }
+
+    mSlots.resize(std::max<size_t>(2, 2 * static_cast<size_t>(iThreads)));
+    for (unsigned i = 0; i < iThreads; ++i)
+    {
+      mWorkers.emplace_back(&ParallelTraceReader::work, this);
+    }
+  }
+
+  ~ParallelTraceReader()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mbStop = true;
+    }
+    mWorkerWakeup.notify_all();
+    for (auto& worker : mWorkers)
+    {
+      worker.join();
+    }
+  }
+
+  ParallelTraceReader(const ParallelTraceReader&) = delete;
+  ParallelTraceReader& operator=(const ParallelTraceReader&) = delete;
+
+  // Same contract as IdaTraceRecordView::readLine: stops at the end of input
+  // or at the first row that could not be parsed
+  bool readLine(IdaTraceRecordView& record)
+  {
+    while (mpCurrent == nullptr || miRecord == mpCurrent->records.size())
+    {
+      if (mpCurrent != nullptr)
+      {
+        if (mpCurrent->bBroken)
+        {
+          return false;
+        }
+        releaseChunk();
+      }
+      if (miChunkRead == mChunkInputs.size())
+      {
+        return false;
+      }
+      mpCurrent = &acquireChunk();
+    }
+
+    record = mpCurrent->records[miRecord++];
+    return true;
+  }
+
+private:
+  struct Chunk
+  {
+    size_t iIndex = 0;
+    bool bReady = false;
+    bool bBroken = false;
+    std::vector<IdaTraceRecordView> records;
+  };
+
+  Chunk& acquireChunk()
+  {
+    Chunk& chunk = mSlots[miChunkRead % mSlots.size()];
+    std::unique_lock<std::mutex> lock(mMutex);
+    mReaderWakeup.wait(lock, [&] { return chunk.bReady && chunk.iIndex == miChunkRead; });
+    miRecord = 0;
+    return chunk;
+  }
+
+  void releaseChunk()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mpCurrent->bReady = false;
+      mpCurrent = nullptr;
+      ++miChunkRead;
+    }
+    mWorkerWakeup.notify_all();
+  }
+
+  void work()
+  {
+    // Separators of the chunk being parsed, reused for every chunk
+    TraceTokens tokens;
+    for (;;)
+    {
+      size_t iIndex;
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWorkerWakeup.wait(lock, [this]
+        {
+          return mbStop || miChunkNext == mChunkInputs.size() || miChunkNext < miChunkRead + mSlots.size();
+        });
+        if (mbStop || miChunkNext == mChunkInputs.size())
+        {
+          return;
+        }
+        iIndex = miChunkNext++;
+      }
+
+      // The slot is free: its previous chunk was released by the reader
+      Chunk& chunk = mSlots[iIndex % mSlots.size()];
+      chunk.records.clear();
+      chunk.bBroken = false;
+
+      const std::string_view sInput = mChunkInputs[iIndex];
+      tokenizeTrace(sInput, tokens);
+      TraceTokenCursor cursor(sInput, tokens);
+      IdaTraceRecordView record;
+      while (!cursor.empty())
+      {
+        if (!IdaTraceRecordView::readLine(cursor, record))
+        {
+          chunk.bBroken = true;
+          break;
+        }
+        chunk.records.push_back(record);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        chunk.iIndex = iIndex;
+        chunk.bReady = true;
+      }
+      mReaderWakeup.notify_all();
+    }
+  }
+
+  std::vector<std::string_view> mChunkInputs;
+  std::vector<Chunk> mSlots;
+  std::vector<std::thread> mWorkers;
+
+  std::mutex mMutex;
+  std::condition_variable mWorkerWakeup;
+  std::condition_variable mReaderWakeup;
+  size_t miChunkNext = 0;
+  size_t miChunkRead = 0;
+  bool mbStop = false;
+
+  Chunk* mpCurrent = nullptr;
+  size_t miRecord = 0;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <ostream>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "IdaCallStackBuilder.h"
+
+// Timings and counts of one run, written by --stats
+struct RunStats
+{
+  struct Phase
+  {
+    std::string sName;
+    double fSeconds = 0;
+    // Records or nodes handled, and the bytes read or written
+    uint64_t iItems = 0;
+    uint64_t iBytes = 0;
+  };
+
+  // A deque, so a phase being timed stays put while others are added
+  std::deque<Phase> phases;
+  uint64_t iInputBytes = 0;
+  uint64_t iRecords = 0;
+  uint64_t iNodes = 0;
+  IdaCallStackStats stack;
+
+  Phase& addPhase(const std::string& sName)
+  {
+    phases.emplace_back();
+    phases.back().sName = sName;
+    return phases.back();
+  }
+
+  // Reads through readRecord and adds the time spent in it to the phase
+  template<class TReadRecord, class TRecord>
+  static bool timedRead(TReadRecord& readRecord, TRecord& record, Phase& phase)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    const bool bRead = readRecord(record);
+    phase.fSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (bRead)
+    {
+      ++phase.iItems;
+    }
+    return bRead;
+  }
+
+  static uint64_t peakResidentBytes()
+  {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+      return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+      return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+  }
+
+  void writeText(std::ostream& output) const
+  {
+    char sLine[160];
+    output << "phase                      seconds        items/s       MB/s\n";
+    for (const auto& phase : phases)
+    {
+      const double fSeconds = phase.fSeconds > 0 ? phase.fSeconds : 1e-9;
+      std::snprintf(sLine, sizeof(sLine), "%-24s %9.3f %14.0f %10.1f\n", phase.sName.c_str(), phase.fSeconds,
+        phase.iItems / fSeconds, phase.iBytes / fSeconds / (1 << 20));
+      output << sLine;
+    }
+    output << "\ninput bytes = " << iInputBytes << "\n";
+    output << "records = " << iRecords << "\n";
+    output << "tree nodes = " << iNodes << "\n";
+    output << "max call depth = " << stack.iMaxDepth << "\n";
+    output << "call stack repairs = " << stack.iRepairs << " (" << stack.iFramesDropped << " calls closed)\n";
+    output << "error nodes = " << stack.iUnmatchedReturns << "\n";
+    output << "peak RSS = " << peakResidentBytes() / (1 << 20) << " MB\n";
+  }
+
+  void writeJson(std::ostream& output) const
+  {
+    char sNumber[64];
+    output << "{\n";
+    output << "  \"input_bytes\": " << iInputBytes << ",\n";
+    output << "  \"records\": " << iRecords << ",\n";
+    output << "  \"tree_nodes\": " << iNodes << ",\n";
+    output << "  \"max_call_depth\": " << stack.iMaxDepth << ",\n";
+    output << "  \"call_stack_repairs\": " << stack.iRepairs << ",\n";
+    output << "  \"calls_closed\": " << stack.iFramesDropped << ",\n";
+    output << "  \"error_nodes\": " << stack.iUnmatchedReturns << ",\n";
+    output << "  \"peak_rss_bytes\": " << peakResidentBytes() << ",\n";
+    output << "  \"phases\": [";
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+      const Phase& phase = phases[i];
+      const double fSeconds = phase.fSeconds > 0 ? phase.fSeconds : 1e-9;
+      output << (i == 0 ? "\n" : ",\n");
+      // Phase names are fixed identifiers, no escaping needed
+      output << "    { \"name\": \"" << phase.sName << "\"";
+      std::snprintf(sNumber, sizeof(sNumber), "%.6f", phase.fSeconds);
+      output << ", \"seconds\": " << sNumber;
+      output << ", \"items\": " << phase.iItems;
+      std::snprintf(sNumber, sizeof(sNumber), "%.1f", phase.iItems / fSeconds);
+      output << ", \"items_per_second\": " << sNumber;
+      output << ", \"bytes\": " << phase.iBytes;
+      std::snprintf(sNumber, sizeof(sNumber), "%.1f", phase.iBytes / fSeconds);
+      output << ", \"bytes_per_second\": " << sNumber << " }";
+    }
+    output << "\n  ]\n}\n";
+  }
+};
+
+// Wall time since construction
+class PhaseTimer
+{
+public:
+  double seconds() const
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point mStart = std::chrono::steady_clock::now();
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "IdaTraceFileRecord.h"
+#include "SymbolTable.h"
+
+// Labels longer than this are cut and end in "..."
+constexpr size_t kDotLabelLength = 50;
+
+// Printed forms of a function symbol (miResult_other of a call)
+struct SymbolLabel
+{
+  // Without the access keyword, as in the text tree
+  std::string_view sName;
+  // Function name only, cut to kDotLabelLength, as in the dot graph
+  std::string sDotLabel;
+  // The whole signature, as in the tooltip of a cluster
+  std::string_view sTooltip;
+};
+
+// Works out the printed forms of every symbol once, so printing does not
+// parse the same signatures again for every call. Each printer has its own,
+// get() is not synchronized.
+class SymbolLabels
+{
+public:
+  const SymbolLabel& get(SymbolId iSymbol)
+  {
+    if (iSymbol >= mSlots.size())
+    {
+      mSlots.resize(static_cast<size_t>(iSymbol) + 1, 0);
+    }
+    uint32_t& iSlot = mSlots[iSymbol];
+    if (iSlot == 0)
+    {
+      const std::string_view sSymbol = symbolName(iSymbol);
+      const std::string_view sFunction = IdaTraceFileRecord::getFunctionNameOnly(sSymbol);
+
+      SymbolLabel& label = mLabels.emplace_back();
+      label.sName = IdaTraceFileRecord::getWithoutAccessKeyword(sSymbol);
+      label.sDotLabel = std::string(sFunction.substr(0, kDotLabelLength));
+      if (sFunction.length() > kDotLabelLength)
+      {
+        label.sDotLabel += "...";
+      }
+      label.sTooltip = sSymbol;
+      iSlot = static_cast<uint32_t>(mLabels.size());
+    }
+    return mLabels[iSlot - 1];
+  }
+
+private:
+  // 1 + index into mLabels by symbol id, 0 while not worked out
+  std::vector<uint32_t> mSlots;
+  std::deque<SymbolLabel> mLabels;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+using SymbolId = uint32_t;
+
+// Interned strings: every distinct string gets a compact id, the characters
+// are kept once in a pool. Id 0 is always the empty string.
+// intern() may be called from several threads; name() does not lock and is
+// safe for any id the calling thread has received through synchronization.
+// The names are found through a directory of chunks; when it grows, the old
+// directory is kept, so a name() running meanwhile never reads freed memory.
+class SymbolTable
+{
+public:
+  SymbolTable()
+  {
+    intern(std::string_view());
+  }
+
+  SymbolTable(const SymbolTable&) = delete;
+  SymbolTable& operator=(const SymbolTable&) = delete;
+
+  SymbolId intern(std::string_view sName)
+  {
+    const size_t iHash = std::hash<std::string_view>()(sName);
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (2 * (miSize + 1) > mIndex.size())
+    {
+      rehash(mIndex.empty() ? 1024 : 2 * mIndex.size());
+    }
+
+    size_t iSlot = iHash & (mIndex.size() - 1);
+    while (mIndex[iSlot].iId != kEmptySlot)
+    {
+      if (mIndex[iSlot].iHash == iHash && name(mIndex[iSlot].iId) == sName)
+      {
+        return mIndex[iSlot].iId;
+      }
+      iSlot = (iSlot + 1) & (mIndex.size() - 1);
+    }
+
+    // The last id marks empty index slots
+    if (miSize >= kEmptySlot)
+    {
+      throw std::length_error("symbol table has more names than SymbolId can number");
+    }
+    const SymbolId iId = static_cast<SymbolId>(miSize);
+    if ((iId >> kChunkBits) == mChunks.size())
+    {
+      addChunk();
+    }
+    mChunks.back()[iId & (kChunkSize - 1)] = store(sName);
+    mIndex[iSlot] = { iHash, iId };
+    ++miSize;
+    return iId;
+  }
+
+  std::string_view name(SymbolId iId) const
+  {
+    return mpDirectory.load(std::memory_order_acquire)[iId >> kChunkBits][iId & (kChunkSize - 1)];
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return miSize;
+  }
+
+private:
+  static constexpr unsigned kChunkBits = 14;
+  static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+  static constexpr size_t kFirstDirectorySize = 16;
+  static constexpr size_t kPoolBlockSize = 1 << 16;
+  static constexpr SymbolId kEmptySlot = ~SymbolId(0);
+
+  struct IndexSlot
+  {
+    size_t iHash = 0;
+    SymbolId iId = kEmptySlot;
+  };
+
+  std::string_view store(std::string_view sName)
+  {
+    if (sName.empty())
+    {
+      return std::string_view();
+    }
+    if (sName.length() > kPoolBlockSize / 4)
+    {
+      // Long names get a block of their own
+      mPool.emplace_back(new char[sName.length()]);
+      std::memcpy(mPool.back().get(), sName.data(), sName.length());
+      return std::string_view(mPool.back().get(), sName.length());
+    }
+    if (mPool.empty() || miPoolUsed + sName.length() > kPoolBlockSize)
+    {
+      mpPoolBlock = new char[kPoolBlockSize];
+      mPool.emplace_back(mpPoolBlock);
+      miPoolUsed = 0;
+    }
+    char* pName = mpPoolBlock + miPoolUsed;
+    std::memcpy(pName, sName.data(), sName.length());
+    miPoolUsed += sName.length();
+    return std::string_view(pName, sName.length());
+  }
+
+  void addChunk()
+  {
+    mChunks.emplace_back(new std::string_view[kChunkSize]);
+    if (mChunks.size() <= miDirectorySize)
+    {
+      // Nobody reads the new entry before getting an id of its chunk
+      mDirectories.back()[mChunks.size() - 1] = mChunks.back().get();
+      return;
+    }
+
+    // Readers may still hold the old directory, it is kept until the end
+    miDirectorySize = mDirectories.empty() ? kFirstDirectorySize : 2 * miDirectorySize;
+    mDirectories.emplace_back(new std::string_view*[miDirectorySize]);
+    std::string_view** pDirectory = mDirectories.back().get();
+    for (size_t i = 0; i < mChunks.size(); ++i)
+    {
+      pDirectory[i] = mChunks[i].get();
+    }
+    mpDirectory.store(pDirectory, std::memory_order_release);
+  }
+
+  void rehash(size_t iSlots)
+  {
+    std::vector<IndexSlot> index(iSlots);
+    for (const auto& slot : mIndex)
+    {
+      if (slot.iId == kEmptySlot)
+      {
+        continue;
+      }
+      size_t iSlot = slot.iHash & (iSlots - 1);
+      while (index[iSlot].iId != kEmptySlot)
+      {
+        iSlot = (iSlot + 1) & (iSlots - 1);
+      }
+      index[iSlot] = slot;
+    }
+    mIndex.swap(index);
+  }
+
+  mutable std::mutex mMutex;
+  std::vector<IndexSlot> mIndex;
+  size_t miSize = 0;
+
+  std::vector<std::unique_ptr<std::string_view[]>> mChunks;
+  std::vector<std::unique_ptr<std::string_view*[]>> mDirectories;
+  size_t miDirectorySize = 0;
+  std::atomic<std::string_view* const*> mpDirectory{ nullptr };
+
+  std::vector<std::unique_ptr<char[]>> mPool;
+  char* mpPoolBlock = nullptr;
+  size_t miPoolUsed = 0;
+};
+
+// Table shared by all trace records
+inline SymbolTable& globalSymbols()
+{
+  static SymbolTable symbols;
+  return symbols;
+}
+
+// Interns into globalSymbols(). A small per-thread cache in front of the
+// table keeps hot symbols off its lock when records are parsed in parallel.
+inline SymbolId internSymbol(std::string_view sName)
+{
+  struct CacheEntry
+  {
+    size_t iHash = 0;
+    SymbolId iId = 0;
+  };
+  static constexpr size_t kCacheSize = 4096;
+  thread_local std::unique_ptr<CacheEntry[]> cache(new CacheEntry[kCacheSize]);
+
+  SymbolTable& symbols = globalSymbols();
+  const size_t iHash = std::hash<std::string_view>()(sName);
+  CacheEntry& entry = cache[iHash & (kCacheSize - 1)];
+  if (entry.iHash == iHash && symbols.name(entry.iId) == sName)
+  {
+    return entry.iId;
+  }
+
+  entry.iHash = iHash;
+  entry.iId = symbols.intern(sName);
+  return entry.iId;
+}
+
+inline std::string_view symbolName(SymbolId iId)
+{
+  return globalSymbols().name(iId);
+}
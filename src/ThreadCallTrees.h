@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "IdaCallStackBuilder.h"
+#include "IdaTracePruner.h"
+#include "SymbolTable.h"
+#include "TraceCallTree.h"
+
+// Call tree of the records of one traced thread
+template<class TRecord>
+struct ThreadCallTree
+{
+  std::string sThread;
+  CallTree<TRecord> tree;
+};
+
+// True for the row of column titles a trace starts with
+template<class TRecord>
+bool isTraceHeaderRow(const TRecord& record)
+{
+  return record.msThread == "Thread" && record.msAddress == "Address" && record.msInstruction == "Instruction";
+}
+
+// Splits the records by msThread and reconstructs the calls of every thread
+// with its own stack, so interleaved threads do not corrupt each other.
+// The records are read on the calling thread and handed out in batches, each
+// traced thread has a bounded queue of them. The trees are built concurrently
+// by iWorkers workers (0 for one per core); a worker takes the next thread
+// with queued batches and builds them while no other worker has that thread.
+// So no copy of the trace is kept next to the trees, only the queued batches.
+// The trees are returned in the order the threads first appear in the trace,
+// a header row is skipped. The repairs of all stacks are summed into pStats.
+// Every tree is pruned on its own by pPrune.
+template<class TRecord, class TReadRecord>
+std::vector<ThreadCallTree<TRecord>> collectThreadTrees(TReadRecord readRecord, unsigned iWorkers = 0, IdaCallStackStats* pStats = nullptr, IdaCallStackRepairLog* pRepairLog = nullptr, const IdaTracePruneOptions* pPrune = nullptr)
+{
+  static const IdaTracePruneOptions noPrune;
+  const IdaTracePruneOptions& prune = pPrune == nullptr ? noPrune : *pPrune;
+
+  // Records a worker is handed at once, and the batches a thread may have
+  // queued before the reader waits for its worker
+  constexpr size_t kBatchSize = 1024;
+  constexpr size_t kMaxQueuedBatches = 4;
+
+  // Builders live in a deque, their appenders and pruners point into it
+  struct ThreadBuilder
+  {
+    ThreadBuilder(std::string sThread, const IdaTracePruneOptions& prune)
+      : appender(result.tree)
+      , pruner(prune, appender)
+    {
+      result.sThread = std::move(sThread);
+    }
+
+    ThreadCallTree<TRecord> result;
+    IdaCallStackBuilder<TRecord> builder;
+    CallTreeAppender<TRecord> appender;
+    IdaTracePruner<CallTreeAppender<TRecord>> pruner;
+
+    // Records read since the last batch was queued, only used by the reader
+    std::vector<TRecord> batch;
+    // Batches not built yet and whether the thread is ready or taken by a
+    // worker, guarded by the mutex
+    std::deque<std::vector<TRecord>> queued;
+    bool bScheduled = false;
+  };
+  std::deque<ThreadBuilder> threads;
+  std::unordered_map<SymbolId, ThreadBuilder*> threadIndex;
+
+  std::mutex mutex;
+  std::condition_variable workReady;
+  std::condition_variable queueFree;
+  // Threads with queued batches no worker has taken
+  std::deque<ThreadBuilder*> ready;
+  bool bRead = false;
+
+  const auto build = [&]()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      workReady.wait(lock, [&]() { return !ready.empty() || bRead; });
+      if (ready.empty())
+      {
+        return;
+      }
+      ThreadBuilder& thread = *ready.front();
+      ready.pop_front();
+
+      while (!thread.queued.empty())
+      {
+        std::vector<TRecord> batch = std::move(thread.queued.front());
+        thread.queued.pop_front();
+        lock.unlock();
+        queueFree.notify_all();
+
+        for (auto& record : batch)
+        {
+          if (prune.empty())
+          {
+            thread.builder.append(record, thread.appender);
+          }
+          else
+          {
+            thread.builder.append(record, thread.pruner);
+          }
+        }
+        batch = std::vector<TRecord>();
+        lock.lock();
+      }
+      thread.bScheduled = false;
+    }
+  };
+
+  const auto queueBatch = [&](ThreadBuilder& thread)
+  {
+    bool bWake = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queueFree.wait(lock, [&]() { return thread.queued.size() < kMaxQueuedBatches; });
+      thread.queued.push_back(std::move(thread.batch));
+      if (!thread.bScheduled)
+      {
+        thread.bScheduled = true;
+        ready.push_back(&thread);
+        bWake = true;
+      }
+    }
+    thread.batch = std::vector<TRecord>();
+    if (bWake)
+    {
+      workReady.notify_one();
+    }
+  };
+
+  if (iWorkers == 0)
+  {
+    iWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < iWorkers; ++i)
+  {
+    workers.emplace_back(build);
+  }
+
+  TRecord record;
+  bool bFirst = true;
+  while (readRecord(record))
+  {
+    if (bFirst)
+    {
+      bFirst = false;
+      if (isTraceHeaderRow(record))
+      {
+        continue;
+      }
+    }
+
+    const SymbolId iThread = internSymbol(record.msThread);
+    auto itThread = threadIndex.find(iThread);
+    if (itThread == threadIndex.end())
+    {
+      threads.emplace_back(std::string(record.msThread), prune);
+      threads.back().builder.setRepairLog(pRepairLog);
+      itThread = threadIndex.emplace(iThread, &threads.back()).first;
+    }
+
+    ThreadBuilder& thread = *itThread->second;
+    if (thread.batch.empty())
+    {
+      thread.batch.reserve(kBatchSize);
+    }
+    thread.batch.push_back(std::move(record));
+    if (thread.batch.size() == kBatchSize)
+    {
+      queueBatch(thread);
+    }
+  }
+
+  for (auto& thread : threads)
+  {
+    if (!thread.batch.empty())
+    {
+      queueBatch(thread);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    bRead = true;
+  }
+  workReady.notify_all();
+  for (auto& worker : workers)
+  {
+    worker.join();
+  }
+
+  // Moving a tree keeps its nodes where they are
+  std::vector<ThreadCallTree<TRecord>> trees;
+  trees.reserve(threads.size());
+  for (auto& thread : threads)
+  {
+    if (pStats != nullptr)
+    {
+      *pStats += thread.builder.stats();
+    }
+    trees.push_back(std::move(thread.result));
+  }
+  return trees;
+}
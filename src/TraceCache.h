@@ -0,0 +1,361 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "IdaTraceRecordView.h"
+#include "MappedFile.h"
+#include "SymbolTable.h"
+#include "TraceCallTree.h"
+
+// Binary cache of a collected call tree, so a trace is parsed only once:
+//
+//   header | nodes in pre-order | string index | string data
+//
+// A node has a fixed width and refers to all its text fields, symbols
+// included, by string index. Equal strings are stored once, the repeated
+// instructions and names of a trace shrink to a small table. Loading maps the
+// file and points the records into it, nothing is parsed or copied.
+struct TraceCacheHeader
+{
+  char magic[8];
+  uint32_t iVersion;
+  uint32_t iNodeSize;
+  uint64_t iNodes;
+  uint64_t iNodesOffset;
+  uint64_t iStrings;
+  uint64_t iStringIndexOffset;
+  uint64_t iStringDataOffset;
+  uint64_t iStringDataSize;
+};
+
+struct TraceCacheNode
+{
+  // The "error" records IdaCallStackBuilder inserts are not part of the trace
+  static constexpr uint32_t kSynthetic = 1;
+
+  uint32_t iDepth;
+  uint32_t iFlags;
+  uint32_t iThread;
+  uint32_t iAddress;
+  uint32_t iAddress_segment;
+  uint32_t iAddress_func;
+  uint32_t iAddress_shift;
+  uint32_t iInstruction;
+  uint32_t iInstruction_name;
+  uint32_t iInstruction_operands;
+  uint32_t iResult;
+  uint32_t iResult_func;
+  uint32_t iResult_comment;
+  uint32_t iResult_module;
+  uint32_t iResult_other;
+  uint32_t iResult_tail;
+};
+
+struct TraceCacheString
+{
+  uint64_t iOffset;
+  uint64_t iLength;
+};
+
+constexpr char kTraceCacheMagic[8] = { 'I', 'D', 'A', 'T', 'R', 'E', 'E', '\0' };
+constexpr uint32_t kTraceCacheVersion = 1;
+
+template<class TRecord>
+struct TraceCacheWriterContext
+{
+  std::ofstream* pOutput = nullptr;
+  std::vector<TraceCacheNode> nodes;
+  uint64_t iNodes = 0;
+
+  // Views into the tree records and the symbol table, both outlive the writer
+  std::vector<std::string_view> strings;
+  std::unordered_map<std::string_view, uint32_t> stringIndex;
+  std::vector<uint32_t> symbolStrings;
+  // Joined texts added by addOwnedString, a deque keeps them in place
+  std::deque<std::string> ownedStrings;
+
+  uint32_t addString(std::string_view sText)
+  {
+    const auto itString = stringIndex.emplace(sText, static_cast<uint32_t>(strings.size()));
+    if (itString.second)
+    {
+      strings.push_back(sText);
+    }
+    return itString.first->second;
+  }
+
+  // Like addString for a text no record holds, it is kept here if new
+  uint32_t addOwnedString(std::string sText)
+  {
+    const auto itString = stringIndex.find(sText);
+    if (itString != stringIndex.end())
+    {
+      return itString->second;
+    }
+    ownedStrings.push_back(std::move(sText));
+    return addString(ownedStrings.back());
+  }
+
+  uint32_t addSymbol(SymbolId iSymbol)
+  {
+    if (iSymbol >= symbolStrings.size())
+    {
+      symbolStrings.resize(iSymbol + 1, ~uint32_t(0));
+    }
+    if (symbolStrings[iSymbol] == ~uint32_t(0))
+    {
+      symbolStrings[iSymbol] = addString(symbolName(iSymbol));
+    }
+    return symbolStrings[iSymbol];
+  }
+
+  void flushNodes()
+  {
+    pOutput->write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(TraceCacheNode));
+    nodes.clear();
+  }
+};
+
+template<class TRecord>
+bool traceCacheWriter(CallTreeNode<TRecord>& info, int iDepth, void* pContext)
+{
+  TraceCacheWriterContext<TRecord>* pWriter = static_cast<TraceCacheWriterContext<TRecord>*>(pContext);
+  if (info.pParent == nullptr)
+  {
+    return true;
+  }
+
+  const TRecord& record = info.value;
+
+  TraceCacheNode node;
+  node.iDepth = static_cast<uint32_t>(iDepth);
+  // Returns are never pushed, so only the inserted error record can be a child of one
+  node.iFlags = info.pParent->value.isReturn() ? TraceCacheNode::kSynthetic : 0;
+  node.iThread = pWriter->addString(record.msThread);
+  node.iAddress = pWriter->addString(record.msAddress);
+  node.iAddress_segment = pWriter->addString(record.getAddressSegment());
+  node.iAddress_func = pWriter->addSymbol(record.miAddress_func);
+  node.iAddress_shift = pWriter->addString(record.getAddressShift());
+  node.iInstruction = pWriter->addString(record.msInstruction);
+  node.iInstruction_name = pWriter->addString(record.getInstructionName());
+  node.iInstruction_operands = pWriter->addString(record.getInstructionOperands());
+  node.iResult = pWriter->addString(record.msResult);
+  node.iResult_func = pWriter->addSymbol(record.miResult_func);
+  node.iResult_comment = pWriter->addString(record.getResultComment());
+  node.iResult_module = pWriter->addSymbol(record.getResultModule());
+  node.iResult_other = pWriter->addSymbol(record.getResultOther());
+  std::string sJoined;
+  const std::string_view sTail = record.getResultTail(sJoined);
+  node.iResult_tail = sJoined.empty() ? pWriter->addString(sTail) : pWriter->addOwnedString(std::move(sJoined));
+
+  pWriter->nodes.push_back(node);
+  ++pWriter->iNodes;
+  if (pWriter->nodes.size() == 4096)
+  {
+    pWriter->flushNodes();
+  }
+  return true;
+}
+
+// Writes the tree to a cache file, false if the file cannot be written
+template<class TRecord>
+bool saveTraceCache(CallTree<TRecord>& tree, const std::string& sPath)
+{
+  std::ofstream output(sPath, std::ios::binary);
+  if (!output)
+  {
+    return false;
+  }
+
+  TraceCacheHeader header = {};
+  std::memcpy(header.magic, kTraceCacheMagic, sizeof(header.magic));
+  header.iVersion = kTraceCacheVersion;
+  header.iNodeSize = sizeof(TraceCacheNode);
+  header.iNodesOffset = sizeof(TraceCacheHeader);
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  TraceCacheWriterContext<TRecord> writer;
+  writer.pOutput = &output;
+  writer.addString(std::string_view());
+  tree.traverse(&traceCacheWriter<TRecord>, 0, &writer);
+  writer.flushNodes();
+
+  header.iNodes = writer.iNodes;
+  header.iStrings = writer.strings.size();
+  header.iStringIndexOffset = header.iNodesOffset + header.iNodes * sizeof(TraceCacheNode);
+
+  std::vector<TraceCacheString> index;
+  index.reserve(writer.strings.size());
+  uint64_t iOffset = 0;
+  for (const auto sText : writer.strings)
+  {
+    index.push_back({ iOffset, sText.length() });
+    iOffset += sText.length();
+  }
+  output.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TraceCacheString));
+
+  header.iStringDataOffset = header.iStringIndexOffset + index.size() * sizeof(TraceCacheString);
+  header.iStringDataSize = iOffset;
+  for (const auto sText : writer.strings)
+  {
+    output.write(sText.data(), sText.length());
+  }
+
+  output.seekp(0);
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  return static_cast<bool>(output);
+}
+
+// Mapped cache file. The records it hands out point into the mapping, so it
+// outlives them.
+class TraceCache
+{
+public:
+  bool open(const std::string& sPath)
+  {
+    if (!mFile.open(sPath) || mFile.size() < sizeof(TraceCacheHeader))
+    {
+      return false;
+    }
+
+    std::memcpy(&mHeader, mFile.data(), sizeof(mHeader));
+    if (std::memcmp(mHeader.magic, kTraceCacheMagic, sizeof(mHeader.magic)) != 0
+      || mHeader.iVersion != kTraceCacheVersion
+      || mHeader.iNodeSize != sizeof(TraceCacheNode)
+      || !hasValidLayout())
+    {
+      return false;
+    }
+
+    mpNodes = reinterpret_cast<const TraceCacheNode*>(mFile.data() + mHeader.iNodesOffset);
+    mpStrings = reinterpret_cast<const TraceCacheString*>(mFile.data() + mHeader.iStringIndexOffset);
+    mpStringData = mFile.data() + mHeader.iStringDataOffset;
+    mSymbols.assign(mHeader.iStrings, kNoSymbol);
+    miNext = 0;
+    return true;
+  }
+
+  size_t fileSize() const { return mFile.size(); }
+
+  // Number of nodes, the root excluded
+  uint64_t size() const { return mHeader.iNodes; }
+
+  // Next record of the trace, the inserted error records are skipped
+  bool readLine(IdaTraceRecordView& record)
+  {
+    while (miNext < mHeader.iNodes)
+    {
+      const TraceCacheNode& node = mpNodes[miNext++];
+      if ((node.iFlags & TraceCacheNode::kSynthetic) == 0)
+      {
+        record = makeRecord(node);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Rebuilds the tree from the stored depths, no call stack is replayed
+  void collectTree(CallTree<IdaTraceRecordView>& tree)
+  {
+    CallTreeAppender<IdaTraceRecordView> appender(tree);
+    for (uint64_t iNode = 0; iNode < mHeader.iNodes; ++iNode)
+    {
+      const uint32_t iDepth = mpNodes[iNode].iDepth;
+      if (iDepth == 0 || iDepth > appender.lastAtDepth.size())
+      {
+        return;
+      }
+      IdaTraceRecordView record = makeRecord(mpNodes[iNode]);
+      appender(record, static_cast<int>(iDepth));
+    }
+  }
+
+private:
+  static constexpr SymbolId kNoSymbol = ~SymbolId(0);
+
+  // The sections must be in order and inside the file. The counts are
+  // checked by division, so a damaged header cannot wrap the sums.
+  bool hasValidLayout() const
+  {
+    const uint64_t iFileSize = mFile.size();
+    if (mHeader.iNodesOffset < sizeof(TraceCacheHeader)
+      || mHeader.iNodesOffset > mHeader.iStringIndexOffset
+      || mHeader.iStringIndexOffset > mHeader.iStringDataOffset
+      || mHeader.iStringDataOffset > iFileSize
+      || mHeader.iNodesOffset % alignof(TraceCacheNode) != 0
+      || mHeader.iStringIndexOffset % alignof(TraceCacheString) != 0)
+    {
+      return false;
+    }
+    return mHeader.iNodes <= (mHeader.iStringIndexOffset - mHeader.iNodesOffset) / sizeof(TraceCacheNode)
+      && mHeader.iStrings <= (mHeader.iStringDataOffset - mHeader.iStringIndexOffset) / sizeof(TraceCacheString)
+      && mHeader.iStringDataSize <= iFileSize - mHeader.iStringDataOffset;
+  }
+
+  // A damaged cache yields empty fields rather than reads outside the mapping
+  std::string_view string(uint32_t iString) const
+  {
+    if (iString >= mHeader.iStrings)
+    {
+      return std::string_view();
+    }
+    const TraceCacheString& entry = mpStrings[iString];
+    if (entry.iOffset > mHeader.iStringDataSize || entry.iLength > mHeader.iStringDataSize - entry.iOffset)
+    {
+      return std::string_view();
+    }
+    return std::string_view(mpStringData + entry.iOffset, static_cast<size_t>(entry.iLength));
+  }
+
+  // Every name is interned once per cache
+  SymbolId symbol(uint32_t iString)
+  {
+    if (iString >= mSymbols.size())
+    {
+      return 0;
+    }
+    if (mSymbols[iString] == kNoSymbol)
+    {
+      mSymbols[iString] = internSymbol(string(iString));
+    }
+    return mSymbols[iString];
+  }
+
+  IdaTraceRecordView makeRecord(const TraceCacheNode& node)
+  {
+    IdaTraceRecordView record;
+    record.msThread = string(node.iThread);
+    record.msAddress = string(node.iAddress);
+    record.msAddress_segment = string(node.iAddress_segment);
+    record.miAddress_func = symbol(node.iAddress_func);
+    record.msAddress_shift = string(node.iAddress_shift);
+    record.msInstruction = string(node.iInstruction);
+    record.msInstruction_name = string(node.iInstruction_name);
+    record.msInstruction_operands = string(node.iInstruction_operands);
+    record.mInstruction_kind = IdaTraceFileRecord::getInstructionKind(record.msInstruction_name);
+    record.msResult = string(node.iResult);
+    record.miResult_func = symbol(node.iResult_func);
+    record.msResult_comment = string(node.iResult_comment);
+    record.miResult_module = symbol(node.iResult_module);
+    record.miResult_other = symbol(node.iResult_other);
+    record.msResult_tail = string(node.iResult_tail);
+    return record;
+  }
+
+  MappedFile mFile;
+  TraceCacheHeader mHeader = {};
+  const TraceCacheNode* mpNodes = nullptr;
+  const TraceCacheString* mpStrings = nullptr;
+  const char* mpStringData = nullptr;
+  std::vector<SymbolId> mSymbols;
+  uint64_t miNext = 0;
+};
@@ -1,7 +1,11 @@
 #pragma once
 
-#include <list>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 template<class T>
 struct CallTreeNode;
@@ -9,46 +13,238 @@ struct CallTreeNode;
 template<class T>
 using CallTreeCallback = bool(*)(CallTreeNode<T>&, int iDepth, void* pContext);
 
+using CallTreeNodeId = uint32_t;
+constexpr CallTreeNodeId kNoCallTreeNode = ~CallTreeNodeId(0);
+
+// Nodes live in the arena of their CallTree and are linked by indices;
+// pParent is kept as a pointer because arena blocks never move
 template<class T>
 struct CallTreeNode
 {
   CallTreeNode* pParent = nullptr;
-  std::list<CallTreeNode> childs;
+  CallTreeNodeId iFirstChild = kNoCallTreeNode;
+  CallTreeNodeId iLastChild = kNoCallTreeNode;
+  CallTreeNodeId iNextSibling = kNoCallTreeNode;
+  // Set by CallTreeSharingAppender: number of the subtree shared with other
+  // calls, 0 if it is not shared
+  uint32_t iShared = 0;
+  // Calls sharing the subtree, kept at the first of them
+  uint32_t iRepeats = 1;
+  // The children were dropped, they are those of the first call numbered iShared
+  bool bSharedRef = false;
   T value;
+};
+
+template<class T>
+struct CallTree
+{
+  // Nodes are allocated in blocks of 2^kBlockBits, so their addresses are stable
+  static constexpr unsigned kBlockBits = 12;
+  static constexpr CallTreeNodeId kBlockSize = 1u << kBlockBits;
+
+  // Drops all nodes and creates an empty root with id 0
+  CallTreeNodeId reset()
+  {
+    mBlocks.clear();
+    miSize = 0;
+    return allocate(nullptr, T());
+  }
 
-  CallTreeNode* appendNode(T record)
+  CallTreeNode<T>& root() { return node(0); }
+
+  CallTreeNode<T>& node(CallTreeNodeId iNode)
   {
-    CallTreeNode node;
-    node.pParent = this;
-    node.value = record;
-    childs.push_back(node);
-    return &childs.back();
+    return mBlocks[iNode >> kBlockBits][iNode & (kBlockSize - 1)];
   }
 
+  size_t size() const { return miSize; }
+
+  // Drops the newest nodes, from id iSize on. Nothing older may link to them.
+  void truncate(size_t iSize)
+  {
+    while (miSize > iSize)
+    {
+      node(static_cast<CallTreeNodeId>(--miSize)) = CallTreeNode<T>();
+    }
+  }
+
+  CallTreeNodeId appendNode(CallTreeNodeId iParent, T&& value)
+  {
+    CallTreeNode<T>& parent = node(iParent);
+    const CallTreeNodeId iNode = allocate(&parent, std::move(value));
+    if (parent.iLastChild == kNoCallTreeNode)
+    {
+      parent.iFirstChild = iNode;
+    }
+    else
+    {
+      node(parent.iLastChild).iNextSibling = iNode;
+    }
+    parent.iLastChild = iNode;
+    return iNode;
+  }
+
+  // Pre-order walk; a callback returning false skips the children of its node
   bool traverse(CallTreeCallback<T> callback, int iDepth, void* pContext)
   {
-    if (!callback(*this, iDepth, pContext))
+    return traverse(0, callback, iDepth, pContext);
+  }
+
+  bool traverse(CallTreeNodeId iStart, CallTreeCallback<T> callback, int iDepth, void* pContext)
+  {
+    return traverse(node(iStart), callback, iDepth, pContext);
+  }
+
+  // Walks the subtree of start only
+  bool traverse(CallTreeNode<T>& start, CallTreeCallback<T> callback, int iDepth, void* pContext)
+  {
+    CallTreeNode<T>* pStart = &start;
+    if (!callback(*pStart, iDepth, pContext))
     {
       return false;
     }
 
-    ++iDepth;
+    CallTreeNode<T>* pCurr = pStart;
+    bool bDescend = true;
+    for (;;)
+    {
+      if (bDescend && pCurr->iFirstChild != kNoCallTreeNode)
+      {
+        pCurr = &node(pCurr->iFirstChild);
+        ++iDepth;
+      }
+      else
+      {
+        // Climb until a node with a next sibling, never above the start node
+        while (pCurr != pStart && pCurr->iNextSibling == kNoCallTreeNode)
+        {
+          pCurr = pCurr->pParent;
+          --iDepth;
+        }
+        if (pCurr == pStart)
+        {
+          return true;
+        }
+        pCurr = &node(pCurr->iNextSibling);
+      }
+
+      bDescend = callback(*pCurr, iDepth, pContext);
+    }
+  }
 
-    for (auto& child : childs)
+private:
+  CallTreeNodeId allocate(CallTreeNode<T>* pParent, T&& value)
+  {
+    // Ids are 32-bit to keep nodes small, the last one means "no node"
+    if (miSize >= kNoCallTreeNode)
     {
-      child.traverse(callback, iDepth, pContext);
+      throw std::length_error("call tree has more nodes than CallTreeNodeId can number");
     }
-    return true;
+    // Blocks emptied by truncate are used again
+    if ((miSize & (kBlockSize - 1)) == 0 && (miSize >> kBlockBits) == mBlocks.size())
+    {
+      mBlocks.emplace_back(new CallTreeNode<T>[kBlockSize]);
+    }
+    const CallTreeNodeId iNode = static_cast<CallTreeNodeId>(miSize++);
+    CallTreeNode<T>& result = node(iNode);
+    result.pParent = pParent;
+    result.value = std::move(value);
+    return iNode;
   }
+
+  std::vector<std::unique_ptr<CallTreeNode<T>[]>> mBlocks;
+  size_t miSize = 0;
 };
 
+// Builds a CallTree from records arriving in pre-order together with their
+// depth, e.g. from IdaCallStackBuilder
 template<class T>
-struct CallTree
+struct CallTreeAppender
 {
-  std::unique_ptr<CallTreeNode<T>> pRoot = nullptr;
+  CallTree<T>* pTree = nullptr;
+  std::vector<CallTreeNodeId> lastAtDepth;
 
-  bool traverse(CallTreeCallback<T> callback, int iDepth, void* pContext)
+  explicit CallTreeAppender(CallTree<T>& tree)
+    : pTree(&tree)
+    , lastAtDepth{ tree.reset() }
   {
-    return pRoot->traverse(callback, iDepth, pContext);
+  }
+
+  void operator()(T& value, int iDepth)
+  {
+    const CallTreeNodeId iNode = pTree->appendNode(lastAtDepth[iDepth - 1], std::move(value));
+    lastAtDepth.resize(iDepth);
+    lastAtDepth.push_back(iNode);
   }
 };
+
+// Lets one traversal feed several callbacks. Each of them keeps its own
+// skipping: a callback returning false misses the subtree of that node while
+// the others still see it. The subtree is pruned once nobody wants it.
+// A callback may count depths from its own base instead of the traversal one.
+template<class T>
+struct CallTreeFanOutContext
+{
+  struct Target
+  {
+    CallTreeCallback<T> callback = nullptr;
+    void* pContext = nullptr;
+    int iDepthBase = 0;
+    int iSkipDepth = -1;
+    // Time spent in the callback, kept only when bTimed is set
+    double fSeconds = 0;
+    uint64_t iVisited = 0;
+  };
+
+  std::vector<Target> targets;
+  bool bTimed = false;
+
+  // Returns the index of the target in targets
+  size_t add(CallTreeCallback<T> callback, void* pContext, int iDepthBase = 0)
+  {
+    targets.push_back({ callback, pContext, iDepthBase, -1, 0, 0 });
+    return targets.size() - 1;
+  }
+};
+
+template<class T>
+bool callTreeFanOut(CallTreeNode<T>& info, int iDepth, void* pContext)
+{
+  CallTreeFanOutContext<T>* pFanOut = static_cast<CallTreeFanOutContext<T>*>(pContext);
+
+  bool bDescend = false;
+  for (auto& target : pFanOut->targets)
+  {
+    if (target.iSkipDepth >= 0)
+    {
+      if (iDepth > target.iSkipDepth)
+      {
+        continue;
+      }
+      target.iSkipDepth = -1;
+    }
+
+    bool bTargetDescend;
+    if (pFanOut->bTimed)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      bTargetDescend = target.callback(info, target.iDepthBase + iDepth, target.pContext);
+      target.fSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      ++target.iVisited;
+    }
+    else
+    {
+      bTargetDescend = target.callback(info, target.iDepthBase + iDepth, target.pContext);
+    }
+
+    if (bTargetDescend)
+    {
+      bDescend = true;
+    }
+    else
+    {
+      target.iSkipDepth = iDepth;
+    }
+  }
+  return bDescend;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "IdaTraceRecordView.h"
+
+// Reads a trace that is still being written. Only complete rows are handed
+// out; at the end of the written part the reader polls the file for appended
+// text. A record points into the reader and is valid until the next call.
+class TraceFollower
+{
+public:
+  // Called before every wait, e.g. to flush the output written so far
+  std::function<void()> onWait;
+
+  // Pause between two looks at the file
+  std::chrono::milliseconds pollInterval{ 100 };
+
+  // fIdleSeconds is how long the file may stop growing before the trace is
+  // taken as complete, 0 to wait until the process is stopped
+  bool open(const std::string& sPath, double fIdleSeconds)
+  {
+    mInput.open(sPath, std::ios::binary);
+    mfIdleSeconds = fIdleSeconds;
+    return mInput.is_open();
+  }
+
+  bool readLine(IdaTraceRecordView& record)
+  {
+    for (;;)
+    {
+      const size_t iNewLine = mBuffer.find('\n', miScanned);
+      if (iNewLine != std::string::npos || (mbComplete && miNext < mBuffer.length()))
+      {
+        const size_t iEnd = iNewLine == std::string::npos ? mBuffer.length() : iNewLine + 1;
+        std::string_view sRow(mBuffer.data() + miNext, iEnd - miNext);
+        miNext = iEnd;
+        miScanned = iEnd;
+        return IdaTraceRecordView::readLine(sRow, record);
+      }
+      miScanned = mBuffer.length();
+
+      if (mbComplete || !readMore())
+      {
+        return false;
+      }
+    }
+  }
+
+  // Bytes of the trace read so far
+  uint64_t size() const { return miRead; }
+
+private:
+  // Appends what was written since the last read, waiting while nothing was
+  bool readMore()
+  {
+    // The rows handed out are no longer needed
+    mBuffer.erase(0, miNext);
+    miScanned -= miNext;
+    miNext = 0;
+
+    const auto lastGrowth = std::chrono::steady_clock::now();
+    for (;;)
+    {
+      // Past the end of the file once, later reads still see what is appended
+      mInput.clear();
+      char chunk[1 << 16];
+      mInput.read(chunk, sizeof(chunk));
+      const std::streamsize iRead = mInput.gcount();
+      if (iRead > 0)
+      {
+        mBuffer.append(chunk, static_cast<size_t>(iRead));
+        miRead += static_cast<uint64_t>(iRead);
+        return true;
+      }
+      if (mInput.bad())
+      {
+        return false;
+      }
+
+      if (mfIdleSeconds > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - lastGrowth).count() >= mfIdleSeconds)
+      {
+        // A last row without a line break is complete now as well
+        mbComplete = true;
+        return true;
+      }
+      if (onWait)
+      {
+        onWait();
+      }
+      std::this_thread::sleep_for(pollInterval);
+    }
+  }
+
+  std::ifstream mInput;
+  double mfIdleSeconds = 0;
+  bool mbComplete = false;
+
+  // Unread text, the rows before miNext were handed out and the text before
+  // miScanned has no line break
+  std::string mBuffer;
+  size_t miNext = 0;
+  size_t miScanned = 0;
+  uint64_t miRead = 0;
+};
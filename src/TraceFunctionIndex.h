@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "CalleeNames.h"
+#include "IdaCallStackBuilder.h"
+#include "IdaTraceRecordView.h"
+#include "MappedFile.h"
+#include "SymbolTable.h"
+
+// Index of the calls of every function in a trace file, so the calls of one
+// function can be rebuilt without reading the rest of the trace:
+//
+//   header | functions sorted by name | calls | name data
+//
+// A call is the byte range from its call row to the end of its matching
+// return row. The rows of a range give the same subtree on their own, so a
+// fresh IdaCallStackBuilder can replay it.
+struct TraceFunctionIndexHeader
+{
+  char magic[8];
+  uint32_t iVersion;
+  uint32_t iCallSize;
+  // Size and fingerprint of the indexed trace, an index of another trace is
+  // not used
+  uint64_t iTraceSize;
+  uint64_t iTraceFingerprint;
+  uint64_t iFunctions;
+  uint64_t iFunctionsOffset;
+  uint64_t iCalls;
+  uint64_t iCallsOffset;
+  uint64_t iNameDataOffset;
+  uint64_t iNameDataSize;
+};
+
+struct TraceFunctionIndexFunction
+{
+  uint64_t iNameOffset;
+  uint64_t iNameLength;
+  uint64_t iFirstCall;
+  uint64_t iCalls;
+};
+
+struct TraceFunctionIndexCall
+{
+  uint64_t iBegin;
+  uint64_t iEnd;
+};
+
+constexpr char kTraceFunctionIndexMagic[8] = { 'I', 'D', 'A', 'I', 'N', 'D', 'X', '\0' };
+constexpr uint32_t kTraceFunctionIndexVersion = 2;
+
+// FNV-1a of the first and the last 64 KB of a trace. Reading them is cheap
+// even for a huge trace, and a trace written again differs in its header
+// rows or its last rows. The hash is spelled out, the index outlives builds.
+inline uint64_t traceFingerprint(std::string_view sTrace)
+{
+  constexpr size_t kBlockSize = size_t(1) << 16;
+  uint64_t iHash = 0xcbf29ce484222325ull;
+  const auto hashBlock = [&iHash](std::string_view sBlock)
+  {
+    for (const char c : sBlock)
+    {
+      iHash = (iHash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+  };
+  hashBlock(sTrace.substr(0, kBlockSize));
+  if (sTrace.length() > kBlockSize)
+  {
+    hashBlock(sTrace.substr(std::max(kBlockSize, sTrace.length() - kBlockSize)));
+  }
+  return iHash;
+}
+
+// Sink of IdaCallStackBuilder over records pointing into the mapped trace.
+// A call stays open until a record at its own depth or above follows it.
+class TraceFunctionIndexBuilder
+{
+public:
+  explicit TraceFunctionIndexBuilder(std::string_view sTrace)
+    : msTrace(sTrace)
+  {
+  }
+
+  template<class TRecord>
+  void operator()(TRecord& record, int iDepth)
+  {
+    // The inserted error records are not part of the trace
+    const char* pRow = record.msThread.data();
+    if (pRow < msTrace.data() || pRow >= msTrace.data() + msTrace.length())
+    {
+      return;
+    }
+
+    const uint64_t iOffset = static_cast<uint64_t>(pRow - msTrace.data());
+    closeCalls(iDepth, iOffset);
+
+    if (record.mInstruction_kind == IdaInstructionKind::Call)
+    {
+      mOpen.push_back({ mCalls.size(), iDepth });
+      mCalls.push_back({ mCalleeNames.get(record), iOffset, msTrace.length() });
+    }
+  }
+
+  // Writes the index, the calls still open end with the trace
+  bool save(const std::string& sPath)
+  {
+    closeCalls(0, msTrace.length());
+
+    std::ofstream output(sPath, std::ios::binary);
+    if (!output)
+    {
+      return false;
+    }
+
+    // Functions by name, their calls in trace order
+    std::vector<SymbolId> functions;
+    std::vector<uint64_t> counts;
+    for (const auto& call : mCalls)
+    {
+      if (call.iFunction >= counts.size())
+      {
+        counts.resize(call.iFunction + 1, 0);
+      }
+      if (counts[call.iFunction]++ == 0)
+      {
+        functions.push_back(call.iFunction);
+      }
+    }
+    std::sort(functions.begin(), functions.end(), [](SymbolId iLeft, SymbolId iRight) { return symbolName(iLeft) < symbolName(iRight); });
+
+    TraceFunctionIndexHeader header = {};
+    std::memcpy(header.magic, kTraceFunctionIndexMagic, sizeof(header.magic));
+    header.iVersion = kTraceFunctionIndexVersion;
+    header.iCallSize = sizeof(TraceFunctionIndexCall);
+    header.iTraceSize = msTrace.length();
+    header.iTraceFingerprint = traceFingerprint(msTrace);
+    header.iFunctions = functions.size();
+    header.iFunctionsOffset = sizeof(TraceFunctionIndexHeader);
+    header.iCalls = mCalls.size();
+    header.iCallsOffset = header.iFunctionsOffset + functions.size() * sizeof(TraceFunctionIndexFunction);
+    header.iNameDataOffset = header.iCallsOffset + mCalls.size() * sizeof(TraceFunctionIndexCall);
+
+    std::vector<TraceFunctionIndexFunction> entries;
+    entries.reserve(functions.size());
+    std::vector<uint64_t> firstCalls(counts.size(), 0);
+    uint64_t iFirstCall = 0;
+    for (const SymbolId iFunction : functions)
+    {
+      entries.push_back({ header.iNameDataSize, symbolName(iFunction).length(), iFirstCall, counts[iFunction] });
+      header.iNameDataSize += symbolName(iFunction).length();
+      firstCalls[iFunction] = iFirstCall;
+      iFirstCall += counts[iFunction];
+    }
+
+    std::vector<TraceFunctionIndexCall> calls(mCalls.size());
+    for (const auto& call : mCalls)
+    {
+      calls[firstCalls[call.iFunction]++] = { call.iBegin, call.iEnd };
+    }
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(TraceFunctionIndexFunction));
+    output.write(reinterpret_cast<const char*>(calls.data()), calls.size() * sizeof(TraceFunctionIndexCall));
+    for (const SymbolId iFunction : functions)
+    {
+      output.write(symbolName(iFunction).data(), symbolName(iFunction).length());
+    }
+    return static_cast<bool>(output);
+  }
+
+  uint64_t size() const { return mCalls.size(); }
+
+private:
+  struct Call
+  {
+    SymbolId iFunction;
+    uint64_t iBegin;
+    uint64_t iEnd;
+  };
+
+  struct OpenCall
+  {
+    size_t iCall;
+    int iDepth;
+  };
+
+  void closeCalls(int iDepth, uint64_t iOffset)
+  {
+    while (!mOpen.empty() && mOpen.back().iDepth >= iDepth)
+    {
+      mCalls[mOpen.back().iCall].iEnd = iOffset;
+      mOpen.pop_back();
+    }
+  }
+
+  std::string_view msTrace;
+  std::vector<Call> mCalls;
+  std::vector<OpenCall> mOpen;
+  CalleeNames mCalleeNames;
+};
+
+// Reads the whole mapped trace once and writes its index
+inline bool buildTraceFunctionIndex(std::string_view sTrace, const std::string& sPath, IdaCallStackStats* pStats = nullptr)
+{
+  TraceFunctionIndexBuilder indexBuilder(sTrace);
+  IdaCallStackBuilder<IdaTraceRecordView> builder;
+  IdaTraceRecordView record;
+  std::string_view sInput = sTrace;
+  while (IdaTraceRecordView::readLine(sInput, record))
+  {
+    builder.append(record, indexBuilder);
+  }
+  if (pStats != nullptr)
+  {
+    *pStats = builder.stats();
+  }
+  return indexBuilder.save(sPath);
+}
+
+// Mapped index file
+class TraceFunctionIndex
+{
+public:
+  using Range = std::pair<uint64_t, uint64_t>;
+
+  bool open(const std::string& sPath)
+  {
+    if (!mFile.open(sPath) || mFile.size() < sizeof(TraceFunctionIndexHeader))
+    {
+      return false;
+    }
+
+    std::memcpy(&mHeader, mFile.data(), sizeof(mHeader));
+    if (std::memcmp(mHeader.magic, kTraceFunctionIndexMagic, sizeof(mHeader.magic)) != 0
+      || mHeader.iVersion != kTraceFunctionIndexVersion
+      || mHeader.iCallSize != sizeof(TraceFunctionIndexCall)
+      || !hasValidLayout())
+    {
+      return false;
+    }
+
+    mpFunctions = reinterpret_cast<const TraceFunctionIndexFunction*>(mFile.data() + mHeader.iFunctionsOffset);
+    mpCalls = reinterpret_cast<const TraceFunctionIndexCall*>(mFile.data() + mHeader.iCallsOffset);
+    mpNameData = mFile.data() + mHeader.iNameDataOffset;
+    return true;
+  }
+
+  // Whether the index was built for this trace
+  bool isIndexOf(std::string_view sTrace) const
+  {
+    return mHeader.iTraceSize == sTrace.length() && mHeader.iTraceFingerprint == traceFingerprint(sTrace);
+  }
+  uint64_t functions() const { return mHeader.iFunctions; }
+  uint64_t calls() const { return mHeader.iCalls; }
+
+  // Ranges of the outermost calls of a function in trace order. Recursive
+  // calls lie inside the range of their first caller and are not repeated.
+  std::vector<Range> ranges(std::string_view sFunction) const
+  {
+    std::vector<Range> result;
+    size_t iLow = 0;
+    size_t iHigh = static_cast<size_t>(mHeader.iFunctions);
+    while (iLow < iHigh)
+    {
+      const size_t iMiddle = iLow + (iHigh - iLow) / 2;
+      if (name(mpFunctions[iMiddle]) < sFunction)
+      {
+        iLow = iMiddle + 1;
+      }
+      else
+      {
+        iHigh = iMiddle;
+      }
+    }
+    if (iLow == mHeader.iFunctions || name(mpFunctions[iLow]) != sFunction)
+    {
+      return result;
+    }
+
+    const TraceFunctionIndexFunction& function = mpFunctions[iLow];
+    if (function.iFirstCall > mHeader.iCalls || function.iCalls > mHeader.iCalls - function.iFirstCall)
+    {
+      return result;
+    }
+    for (uint64_t iCall = function.iFirstCall; iCall < function.iFirstCall + function.iCalls; ++iCall)
+    {
+      const TraceFunctionIndexCall& call = mpCalls[iCall];
+      if (call.iBegin >= call.iEnd || call.iEnd > mHeader.iTraceSize)
+      {
+        continue;
+      }
+      if (!result.empty() && call.iBegin < result.back().second)
+      {
+        continue;
+      }
+      result.emplace_back(call.iBegin, call.iEnd);
+    }
+    return result;
+  }
+
+private:
+  // The sections must be in order and inside the file. The counts are
+  // checked by division, so a damaged header cannot wrap the sums.
+  bool hasValidLayout() const
+  {
+    const uint64_t iFileSize = mFile.size();
+    if (mHeader.iFunctionsOffset < sizeof(TraceFunctionIndexHeader)
+      || mHeader.iFunctionsOffset > mHeader.iCallsOffset
+      || mHeader.iCallsOffset > mHeader.iNameDataOffset
+      || mHeader.iNameDataOffset > iFileSize
+      || mHeader.iFunctionsOffset % alignof(TraceFunctionIndexFunction) != 0
+      || mHeader.iCallsOffset % alignof(TraceFunctionIndexCall) != 0)
+    {
+      return false;
+    }
+    return mHeader.iFunctions <= (mHeader.iCallsOffset - mHeader.iFunctionsOffset) / sizeof(TraceFunctionIndexFunction)
+      && mHeader.iCalls <= (mHeader.iNameDataOffset - mHeader.iCallsOffset) / sizeof(TraceFunctionIndexCall)
+      && mHeader.iNameDataSize <= iFileSize - mHeader.iNameDataOffset;
+  }
+
+  // A damaged index yields empty names rather than reads outside the mapping
+  std::string_view name(const TraceFunctionIndexFunction& function) const
+  {
+    if (function.iNameOffset > mHeader.iNameDataSize || function.iNameLength > mHeader.iNameDataSize - function.iNameOffset)
+    {
+      return std::string_view();
+    }
+    return std::string_view(mpNameData + function.iNameOffset, static_cast<size_t>(function.iNameLength));
+  }
+
+  MappedFile mFile;
+  TraceFunctionIndexHeader mHeader = {};
+  const TraceFunctionIndexFunction* mpFunctions = nullptr;
+  const TraceFunctionIndexCall* mpCalls = nullptr;
+  const char* mpNameData = nullptr;
+};
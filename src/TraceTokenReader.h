@@ -0,0 +1,61 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+#include "IdaTraceRecordView.h"
+#include "TraceTokenizer.h"
+
+// Reads the rows of a mapped trace block by block. Every block is tokenized
+// at once and its rows are split at the offsets found, so the text is scanned
+// for separators only once. Records are views into sInput.
+class TraceTokenReader
+{
+public:
+  explicit TraceTokenReader(std::string_view sInput, size_t iBlockSize = 1 << 20)
+    : msInput(sInput)
+    , miBlockSize(iBlockSize)
+  {
+  }
+
+  // Same contract as IdaTraceRecordView::readLine
+  bool readLine(IdaTraceRecordView& record)
+  {
+    if ((!mCursor || mCursor->empty()) && !nextBlock())
+    {
+      return false;
+    }
+    return IdaTraceRecordView::readLine(*mCursor, record);
+  }
+
+private:
+  // Tokenizes the next block, it ends right after a new line
+  bool nextBlock()
+  {
+    if (msInput.empty())
+    {
+      return false;
+    }
+
+    size_t iEnd = msInput.length();
+    if (miBlockSize < msInput.length())
+    {
+      const size_t iNewLine = msInput.find('\n', miBlockSize);
+      if (iNewLine != std::string_view::npos)
+      {
+        iEnd = iNewLine + 1;
+      }
+    }
+    const std::string_view sBlock = msInput.substr(0, iEnd);
+    msInput.remove_prefix(iEnd);
+
+    tokenizeTrace(sBlock, mTokens);
+    mCursor.emplace(sBlock, mTokens);
+    return true;
+  }
+
+  std::string_view msInput;
+  const size_t miBlockSize;
+  TraceTokens mTokens;
+  std::optional<TraceTokenCursor> mCursor;
+};
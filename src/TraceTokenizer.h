@@ -0,0 +1,235 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define IDATRACE2TREE_TOKENIZER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IDATRACE2TREE_TOKENIZER_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+inline unsigned countTrailingZeros(uint64_t iMask)
+{
+#if defined(_MSC_VER)
+  unsigned long iIndex;
+  _BitScanForward64(&iIndex, iMask);
+  return static_cast<unsigned>(iIndex);
+#else
+  return static_cast<unsigned>(__builtin_ctzll(iMask));
+#endif
+}
+
+// Separators of a block of trace text as bit masks, bit i % 64 of word
+// i / 64 stands for byte i: rows and cells end at the new lines and tabs in
+// separators, instructions and results are split at spaces
+struct TraceTokens
+{
+  std::vector<uint64_t> separators;
+  std::vector<uint64_t> spaces;
+};
+
+// Instruction set the tokenizer was built for, AVX2 with IDATRACE2TREE_AVX2
+inline const char* traceTokenizerPath()
+{
+#if defined(IDATRACE2TREE_TOKENIZER_AVX2)
+  return "avx2";
+#elif defined(IDATRACE2TREE_TOKENIZER_SSE2)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// Finds all separators of sBlock in one pass, 32 or 16 bytes per compare
+// where the instruction set allows
+inline void tokenizeTrace(std::string_view sBlock, TraceTokens& tokens)
+{
+  const char* pData = sBlock.data();
+  const size_t iLength = sBlock.length();
+  const size_t iWords = (iLength + 63) / 64;
+  tokens.separators.resize(iWords);
+  tokens.spaces.resize(iWords);
+
+  size_t iWord = 0;
+#if defined(IDATRACE2TREE_TOKENIZER_AVX2)
+  const __m256i newLine = _mm256_set1_epi8('\n');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i space = _mm256_set1_epi8(' ');
+  for (; (iWord + 1) * 64 <= iLength; ++iWord)
+  {
+    uint64_t iSeparators = 0;
+    uint64_t iSpaces = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+      const __m256i text = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pData + iWord * 64 + i * 32));
+      const __m256i separator = _mm256_or_si256(_mm256_cmpeq_epi8(text, newLine), _mm256_cmpeq_epi8(text, tab));
+      iSeparators |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(separator))) << (i * 32);
+      iSpaces |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(text, space)))) << (i * 32);
+    }
+    tokens.separators[iWord] = iSeparators;
+    tokens.spaces[iWord] = iSpaces;
+  }
+#elif defined(IDATRACE2TREE_TOKENIZER_SSE2)
+  const __m128i newLine = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; (iWord + 1) * 64 <= iLength; ++iWord)
+  {
+    uint64_t iSeparators = 0;
+    uint64_t iSpaces = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      const __m128i text = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + iWord * 64 + i * 16));
+      const __m128i separator = _mm_or_si128(_mm_cmpeq_epi8(text, newLine), _mm_cmpeq_epi8(text, tab));
+      iSeparators |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(separator))) << (i * 16);
+      iSpaces |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(text, space)))) << (i * 16);
+    }
+    tokens.separators[iWord] = iSeparators;
+    tokens.spaces[iWord] = iSpaces;
+  }
+#endif
+
+  // The rest of the block, or all of it without SSE2
+  for (; iWord < iWords; ++iWord)
+  {
+    uint64_t iSeparators = 0;
+    uint64_t iSpaces = 0;
+    for (size_t i = iWord * 64; i < iLength && i < (iWord + 1) * 64; ++i)
+    {
+      const uint64_t iBit = uint64_t(1) << (i % 64);
+      if (pData[i] == '\n' || pData[i] == '\t')
+      {
+        iSeparators |= iBit;
+      }
+      else if (pData[i] == ' ')
+      {
+        iSpaces |= iBit;
+      }
+    }
+    tokens.separators[iWord] = iSeparators;
+    tokens.spaces[iWord] = iSpaces;
+  }
+}
+
+// Walks the rows of a tokenized block front to back. The separators are
+// visited one after the other, each bit of the masks is looked at once.
+class TraceTokenCursor
+{
+public:
+  TraceTokenCursor(std::string_view sBlock, const TraceTokens& tokens)
+    : msBlock(sBlock)
+    , mTokens(tokens)
+    , miSeparators(tokens.separators.empty() ? 0 : tokens.separators[0])
+  {
+  }
+
+  bool empty() const { return miNext >= msBlock.length(); }
+
+  // Next row cut into four cells, the same cells as
+  // IdaTraceRecordView::readCells
+  bool readCells(std::array<std::string_view, 4>& cells)
+  {
+    if (empty())
+    {
+      return false;
+    }
+
+    const size_t iBegin = miNext;
+    size_t iPos = iBegin;
+    for (auto& cell : cells)
+    {
+      const size_t iSeparator = nextSeparator();
+      if (iSeparator < msBlock.length() && msBlock[iSeparator] == '\t')
+      {
+        cell = msBlock.substr(iPos, iSeparator - iPos);
+        iPos = iSeparator + 1;
+        continue;
+      }
+
+      // The row ends here, a trailing '\r' is dropped
+      miNext = iSeparator + 1;
+      size_t iEnd = iSeparator;
+      if (iEnd > iBegin && msBlock[iEnd - 1] == '\r')
+      {
+        --iEnd;
+      }
+      if (iPos >= iEnd || &cell != &cells.back())
+      {
+        return false;
+      }
+      cell = msBlock.substr(iPos, iEnd - iPos);
+      return true;
+    }
+
+    // Cells after the fourth are ignored
+    size_t iSeparator = nextSeparator();
+    while (iSeparator < msBlock.length() && msBlock[iSeparator] != '\n')
+    {
+      iSeparator = nextSeparator();
+    }
+    miNext = iSeparator + 1;
+    return true;
+  }
+
+  // Same as sField.find(' ', iFrom) for a field in the block
+  size_t findSpace(std::string_view sField, size_t iFrom) const
+  {
+    const size_t iField = static_cast<size_t>(sField.data() - msBlock.data());
+    const size_t iEnd = iField + sField.length();
+    size_t iPos = iField + iFrom;
+    if (iPos >= iEnd)
+    {
+      return std::string_view::npos;
+    }
+
+    size_t iWord = iPos / 64;
+    uint64_t iMask = mTokens.spaces[iWord] & (~uint64_t(0) << (iPos % 64));
+    while (iMask == 0)
+    {
+      if (++iWord * 64 >= iEnd)
+      {
+        return std::string_view::npos;
+      }
+      iMask = mTokens.spaces[iWord];
+    }
+
+    iPos = iWord * 64 + countTrailingZeros(iMask);
+    return iPos < iEnd ? iPos - iField : std::string_view::npos;
+  }
+
+private:
+  // Position of the next tab or new line, the block length after the last
+  size_t nextSeparator()
+  {
+    while (miSeparators == 0)
+    {
+      if (++miWord >= mTokens.separators.size())
+      {
+        miWord = mTokens.separators.size();
+        return msBlock.length();
+      }
+      miSeparators = mTokens.separators[miWord];
+    }
+
+    const size_t iPos = miWord * 64 + countTrailingZeros(miSeparators);
+    miSeparators &= miSeparators - 1;
+    return iPos;
+  }
+
+  std::string_view msBlock;
+  const TraceTokens& mTokens;
+  size_t miNext = 0;
+
+  // Separators of word miWord not visited yet
+  size_t miWord = 0;
+  uint64_t miSeparators = 0;
+};
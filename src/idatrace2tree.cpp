@@ -1,152 +1,958 @@
 
 #include "CmdOpts.h"
+#include "AsyncFileWriter.h"
+#include "CallTreeDiff.h"
+#include "CallTreeSharing.h"
+#include "CallTreeSpill.h"
+#include "IdaCallPathProfile.h"
+#include "IdaCallStackBuilder.h"
+#include "IdaDotShards.h"
 #include "IdaTraceFileRecord.h"
+#include "IdaTraceEventWriter.h"
+#include "IdaTracePruner.h"
+#include "IdaTraceRecordView.h"
+#include "MappedFile.h"
+#include "OutputBuffer.h"
+#include "ParallelTraceReader.h"
+#include "RunStats.h"
+#include "ThreadCallTrees.h"
+#include "TraceCache.h"
 #include "TraceCallTree.h"
-#include "PrettyPrintUtils.h"
+#include "TraceFollower.h"
+#include "TraceFunctionIndex.h"
+#include "TraceTokenReader.h"
 #include "IdaTreePrinters.h"
+#include "IdaTreeDiffPrinters.h"
 
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <stack>
 
-void fixStack(std::list<CallTreeNode<IdaTraceFileRecord>*>& stack, const IdaTraceFileRecord& record)
+struct CurrOpts
 {
-  for (auto itCurr = stack.rbegin(); itCurr != stack.rend(); ++itCurr)
+  std::string sInputFile{};
+  std::string sOutputFile{};
+  std::string sFiltersFile{};
+  std::string sColumnsFile{};
+  std::string sType{ "all" };
+  bool bMapInput{ false };
+  int iThreads{ 1 };
+  bool bStream{ false };
+  std::string sTextOutputFile{};
+  std::string sDotOutputFile{};
+  std::string sByThread{};
+  std::string sCacheOutFile{};
+  std::string sCacheInFile{};
+  std::string sRepairLogFile{};
+  int iTop{ 50 };
+  std::string sStats{};
+  std::string sStatsFile{};
+  std::string sIndexFile{};
+  std::string sFocus{};
+  int iMaxDepth{ 0 };
+  std::string sRoot{};
+  bool bFollow{ false };
+  double fFollowIdle{ 0 };
+  int iDotShardDepth{ 0 };
+  int iDotShardNodes{ 0 };
+  bool bShareSubtrees{ false };
+  std::string sDiffFile{};
+  int iMemoryLimit{ 0 };
+};
+
+std::string getTextOutputFile(const CurrOpts& options)
+{
+  return options.sTextOutputFile.empty() ? options.sOutputFile : options.sTextOutputFile;
+}
+
+// With --type all the dot graph goes next to the text tree
+std::string getDotOutputFile(const CurrOpts& options)
+{
+  if (!options.sDotOutputFile.empty())
+  {
+    return options.sDotOutputFile;
+  }
+  return options.sType == "all" ? options.sOutputFile + ".dot" : options.sOutputFile;
+}
+
+// The filters are applied while reading, unless the whole tree is cached
+IdaTracePruneOptions getPruneOptions(const CurrOpts& options, const IdaTraceFilters& filters)
+{
+  IdaTracePruneOptions prune;
+  prune.pFilters = options.sCacheOutFile.empty() ? &filters : nullptr;
+  prune.iMaxDepth = options.iMaxDepth;
+  prune.sRoot = options.sRoot;
+  return prune;
+}
+
+// Hands every record read to the sink with its depth, dropping the pruned ones
+template<class TRecord, class TReadRecord, class TSink>
+IdaCallStackStats buildCalls(TReadRecord& readRecord, TSink& sink, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog)
+{
+  IdaCallStackBuilder<TRecord> builder;
+  builder.setRepairLog(pRepairLog);
+
+  TRecord record;
+  if (prune.empty())
+  {
+    while (readRecord(record))
+    {
+      builder.append(record, sink);
+    }
+  }
+  else
   {
-    if ((*itCurr)->value.msAddress_func == record.msResult_other)
+    IdaTracePruner<TSink> pruner(prune, sink);
+    while (readRecord(record))
     {
-      auto itCurrF = std::next(itCurr).base();
-      auto iDist = std::distance(itCurrF, stack.end());
+      builder.append(record, pruner);
+    }
+  }
+  return builder.stats();
+}
+
+template<class TRecord, class TReadRecord>
+IdaCallStackStats collectTree(CallTree<TRecord>& tree, TReadRecord readRecord, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog, CallTreeSharingStats* pSharing = nullptr)
+{
+  // Repeated subtrees are shared while the tree is built
+  if (pSharing != nullptr)
+  {
+    CallTreeSharingAppender<TRecord> appender(tree);
+    const IdaCallStackStats stats = buildCalls<TRecord>(readRecord, appender, prune, pRepairLog);
+    appender.finish();
+    *pSharing = appender.stats();
+    return stats;
+  }
+
+  CallTreeAppender<TRecord> appender(tree);
+  return buildCalls<TRecord>(readRecord, appender, prune, pRepairLog);
+}
 
-      if (iDist > 1)
+// Folded stacks go to the output, the hottest functions next to it
+void writeProfile(const IdaCallPathProfile& profile, const CurrOpts& options)
+{
+  const std::string sOutputFile = getTextOutputFile(options);
+
+  AsyncFileStream foldedOutput(sOutputFile);
+  OutputBuffer foldedBuffer(foldedOutput.rdbuf());
+  profile.writeFolded(foldedBuffer);
+  foldedBuffer.flush();
+  foldedOutput.close();
+
+  AsyncFileStream topOutput(sOutputFile + ".top");
+  OutputBuffer topBuffer(topOutput.rdbuf());
+  profile.writeTop(topBuffer, static_cast<size_t>(std::max(0, options.iTop)));
+  topBuffer.flush();
+  topOutput.close();
+}
+
+// Every requested format is written by its own printer during one traversal
+// per tree. Titled trees are printed as sections of the same output.
+template<class TRecord>
+void printTrees(const std::vector<std::pair<std::string, CallTree<TRecord>*>>& trees, bool bTitled, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats = nullptr)
+{
+  CallTreeFanOutContext<TRecord> fanOut;
+  fanOut.bTimed = pStats != nullptr;
+
+  std::unique_ptr<AsyncFileStream> pTextOutput;
+  OutputBuffer textBuffer;
+  IdaTreeTabbedPrinterContext textContext;
+  if (options.sType == "all" || options.sType == "text")
+  {
+    pTextOutput.reset(new AsyncFileStream(getTextOutputFile(options)));
+    textBuffer.setTarget(pTextOutput->rdbuf());
+    textContext.pOutput = &textBuffer;
+    textContext.iDepthPrev = 0;
+    textContext.pFilters = &filters;
+    fanOut.add(&treeTabbedTextPrinter<TRecord>, &textContext);
+  }
+
+  // A sharded graph is drawn after the traversal, from the whole tree
+  const bool bDotShards = (options.sType == "all" || options.sType == "dot") && (options.iDotShardDepth > 0 || options.iDotShardNodes > 0);
+
+  std::unique_ptr<AsyncFileStream> pDotOutput;
+  OutputBuffer dotBuffer;
+  IdaTreeDotPrinterContext<TRecord> dotContext;
+  size_t iDotTarget = 0;
+  if ((options.sType == "all" || options.sType == "dot") && !bDotShards)
+  {
+    pDotOutput.reset(new AsyncFileStream(getDotOutputFile(options)));
+    dotBuffer.setTarget(pDotOutput->rdbuf());
+    dotContext.pOutput = &dotBuffer;
+    dotContext.iDepthPrev = 0;
+    dotContext.pFilters = &filters;
+    treeDotTextPrinterHeader<TRecord>(&dotContext);
+    iDotTarget = fanOut.add(&treeDotTextPrinter<TRecord>, &dotContext, dotContext.iDepthPrev);
+  }
+
+  IdaCallPathProfile profile;
+  const bool bProfile = options.sType == "profile";
+  if (bProfile)
+  {
+    profile.pFilters = &filters;
+    fanOut.add(&treeProfileCollector<TRecord>, &profile);
+  }
+
+  for (auto& titledTree : trees)
+  {
+    if (bTitled && pTextOutput)
+    {
+      treeTabbedTextPrinterSection(&textContext, titledTree.first);
+    }
+    if (bTitled && pDotOutput)
+    {
+      treeDotTextPrinterSectionBegin<TRecord>(&dotContext, titledTree.first);
+      fanOut.targets[iDotTarget].iDepthBase = dotContext.iDepthPrev;
+    }
+    if (bTitled && bProfile)
+    {
+      profile.beginRoot(titledTree.first);
+    }
+
+    titledTree.second->traverse(&callTreeFanOut<TRecord>, 0, &fanOut);
+
+    if (bTitled && pDotOutput)
+    {
+      treeDotTextPrinterSectionEnd<TRecord>(&dotContext);
+    }
+  }
+
+  // The targets were added in this order
+  auto itTarget = fanOut.targets.begin();
+  if (pTextOutput)
+  {
+    PhaseTimer closeTimer;
+    textBuffer.flush();
+    pTextOutput->close();
+    if (pStats != nullptr)
+    {
+      RunStats::Phase& phase = pStats->addPhase("text print");
+      phase.fSeconds = itTarget->fSeconds + closeTimer.seconds();
+      phase.iItems = itTarget->iVisited;
+      phase.iBytes = textBuffer.size();
+    }
+    ++itTarget;
+  }
+  if (bDotShards)
+  {
+    PhaseTimer shardTimer;
+    IdaDotShardOptions shardOptions;
+    shardOptions.iDepth = options.iDotShardDepth;
+    shardOptions.iMaxNodes = static_cast<uint64_t>(std::max(0, options.iDotShardNodes));
+    const IdaDotShardStats shardStats = writeDotShards(*trees.front().second, getDotOutputFile(options), &filters, shardOptions);
+    std::cout << "dot shards = " << shardStats.iShards << endl;
+    if (pStats != nullptr)
+    {
+      RunStats::Phase& phase = pStats->addPhase("dot print");
+      phase.fSeconds = shardTimer.seconds();
+      phase.iItems = shardStats.iNodes;
+      phase.iBytes = shardStats.iBytes;
+    }
+  }
+  if (pDotOutput)
+  {
+    PhaseTimer footerTimer;
+    treeDotTextPrinterFooter<TRecord>(&dotContext);
+    dotBuffer.flush();
+    pDotOutput->close();
+    if (pStats != nullptr)
+    {
+      RunStats::Phase& phase = pStats->addPhase("dot print");
+      phase.fSeconds = itTarget->fSeconds + footerTimer.seconds();
+      phase.iItems = itTarget->iVisited;
+      phase.iBytes = dotBuffer.size();
+    }
+    ++itTarget;
+  }
+  if (bProfile)
+  {
+    PhaseTimer writeTimer;
+    writeProfile(profile, options);
+    if (pStats != nullptr)
+    {
+      RunStats::Phase& phase = pStats->addPhase("profile");
+      phase.fSeconds = itTarget->fSeconds + writeTimer.seconds();
+      phase.iItems = itTarget->iVisited;
+    }
+  }
+}
+
+// Writes the text tree of a tree built with a memory limit, the spilled
+// nodes are read back in order
+template<class TRecord>
+void printSpilledTree(CallTreeSpill<TRecord>& tree, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats = nullptr)
+{
+  PhaseTimer printTimer;
+  AsyncFileStream textOutput(getTextOutputFile(options));
+  OutputBuffer textBuffer(textOutput.rdbuf());
+  IdaTreeTabbedPrinterContext textContext;
+  textContext.pOutput = &textBuffer;
+  textContext.iDepthPrev = 0;
+  textContext.pFilters = &filters;
+  tree.traverse(&treeTabbedTextPrinter<TRecord>, 0, &textContext);
+  textBuffer.flush();
+  textOutput.close();
+  if (pStats != nullptr)
+  {
+    RunStats::Phase& phase = pStats->addPhase("text print");
+    phase.fSeconds = printTimer.seconds();
+    phase.iItems = tree.size();
+    phase.iBytes = textBuffer.size();
+  }
+}
+
+template<class TRecord>
+void printTree(CallTree<TRecord>& tree, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats = nullptr)
+{
+  printTrees<TRecord>({ { std::string(), &tree } }, false, options, filters, pStats);
+}
+
+// One tree per traced thread, as sections of one output or as separate files
+template<class TRecord>
+void printThreads(std::vector<ThreadCallTree<TRecord>>& threadTrees, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats)
+{
+  if (options.sByThread == "files")
+  {
+    for (auto& threadTree : threadTrees)
+    {
+      CurrOpts threadOptions = options;
+      threadOptions.sTextOutputFile = getTextOutputFile(options) + "." + threadTree.sThread;
+      threadOptions.sDotOutputFile = getDotOutputFile(options) + "." + threadTree.sThread;
+      printTree(threadTree.tree, threadOptions, filters, pStats);
+    }
+    return;
+  }
+
+  std::vector<std::pair<std::string, CallTree<TRecord>*>> trees;
+  for (auto& threadTree : threadTrees)
+  {
+    trees.emplace_back(threadTree.sThread, &threadTree.tree);
+  }
+  printTrees(trees, true, options, filters, pStats);
+}
+
+// Writes the text tree while the records are read, only the call stack is kept.
+// Whenever a followed trace waits for more rows, the tree so far is written out.
+template<class TRecord, class TReadRecord>
+IdaCallStackStats streamTree(TReadRecord readRecord, const CurrOpts& options, const IdaTraceFilters& filters, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog, TraceFollower* pFollower)
+{
+  std::ofstream fileOutput(getTextOutputFile(options));
+  OutputBuffer outputBuffer(fileOutput.rdbuf());
+  if (pFollower != nullptr)
+  {
+    pFollower->onWait = [&outputBuffer, &fileOutput]()
+    {
+      outputBuffer.flush();
+      fileOutput.flush();
+    };
+  }
+  IdaTreeTabbedStreamPrinter<TRecord> printer;
+  printer.context.pOutput = &outputBuffer;
+  printer.context.iDepthPrev = 0;
+  printer.context.pFilters = &filters;
+  printer.begin();
+
+  const IdaCallStackStats stats = buildCalls<TRecord>(readRecord, printer, prune, pRepairLog);
+  if (pFollower != nullptr)
+  {
+    pFollower->onWait = nullptr;
+  }
+  outputBuffer.flush();
+  fileOutput.close();
+  return stats;
+}
+
+// Counts the call paths while the records are read, no tree is built
+template<class TRecord, class TReadRecord>
+IdaCallStackStats profileTrace(TReadRecord readRecord, const CurrOpts& options, const IdaTraceFilters& filters, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog)
+{
+  IdaCallPathProfile profile;
+  profile.pFilters = &filters;
+
+  const IdaCallStackStats stats = buildCalls<TRecord>(readRecord, profile, prune, pRepairLog);
+  writeProfile(profile, options);
+  return stats;
+}
+
+// Writes every call as a begin and an end trace event while the records are
+// read, one track per traced thread
+template<class TRecord, class TReadRecord>
+IdaCallStackStats writeTraceEvents(TReadRecord readRecord, const CurrOpts& options, const IdaTracePruneOptions& prune, IdaCallStackRepairLog* pRepairLog)
+{
+  AsyncFileStream fileOutput(getTextOutputFile(options));
+  OutputBuffer outputBuffer(fileOutput.rdbuf());
+  IdaTraceEventWriter<TRecord> writer(outputBuffer, prune, pRepairLog);
+
+  TRecord record;
+  while (readRecord(record))
+  {
+    writer.append(record);
+  }
+  writer.finish();
+  outputBuffer.flush();
+  fileOutput.close();
+
+  std::cout << "trace event calls = " << writer.calls() << endl;
+  return writer.stats();
+}
+
+template<class TRecord, class TReadRecord>
+void processTrace(TReadRecord readRecord, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats, TraceFollower* pFollower = nullptr)
+{
+  std::ofstream repairLogOutput;
+  IdaCallStackRepairLog repairLog;
+  IdaCallStackRepairLog* pRepairLog = nullptr;
+  if (!options.sRepairLogFile.empty())
+  {
+    repairLogOutput.open(options.sRepairLogFile);
+    repairLog.pOutput = &repairLogOutput;
+    repairLog.writeHeader();
+    pRepairLog = &repairLog;
+  }
+
+  // Reading is timed record by record, the stage it feeds gets the rest
+  RunStats::Phase* pParse = nullptr;
+  if (pStats != nullptr)
+  {
+    pParse = &pStats->addPhase("parse");
+    pParse->iBytes = pStats->iInputBytes;
+  }
+  const auto readTimed = [&readRecord, pParse](TRecord& record)
+  {
+    return pParse == nullptr ? readRecord(record) : RunStats::timedRead(readRecord, record, *pParse);
+  };
+  const auto addIngestPhase = [pStats, pParse](const char* sName, const PhaseTimer& timer)
+  {
+    if (pStats != nullptr)
+    {
+      RunStats::Phase& phase = pStats->addPhase(sName);
+      phase.fSeconds = timer.seconds() - pParse->fSeconds;
+      phase.iItems = pParse->iItems;
+      phase.iBytes = pParse->iBytes;
+    }
+  };
+
+  const IdaTracePruneOptions prune = getPruneOptions(options, filters);
+  IdaCallStackStats stats;
+  uint64_t iNodes = 0;
+  PhaseTimer ingestTimer;
+  if (options.bStream)
+  {
+    stats = streamTree<TRecord>(readTimed, options, filters, prune, pRepairLog, pFollower);
+    addIngestPhase("tree build + text print", ingestTimer);
+  }
+  else if (!options.sByThread.empty())
+  {
+    std::vector<ThreadCallTree<TRecord>> threadTrees = collectThreadTrees<TRecord>(readTimed, 0, &stats, pRepairLog, &prune);
+    addIngestPhase("tree build", ingestTimer);
+    for (const auto& threadTree : threadTrees)
+    {
+      iNodes += threadTree.tree.size();
+    }
+
+    printThreads(threadTrees, options, filters, pStats);
+  }
+  else if (options.sType == "profile")
+  {
+    stats = profileTrace<TRecord>(readTimed, options, filters, prune, pRepairLog);
+    addIngestPhase("tree build + profile", ingestTimer);
+  }
+  else if (options.sType == "json")
+  {
+    stats = writeTraceEvents<TRecord>(readTimed, options, prune, pRepairLog);
+    addIngestPhase("tree build + trace events", ingestTimer);
+  }
+  else if (options.iMemoryLimit > 0)
+  {
+    // Complete calls are moved to a spill file next to the output
+    CallTreeSpill<TRecord> tree(getTextOutputFile(options) + ".spill", static_cast<uint64_t>(options.iMemoryLimit) << 20);
+    stats = buildCalls<TRecord>(readTimed, tree, prune, pRepairLog);
+    addIngestPhase("tree build", ingestTimer);
+    iNodes = tree.size();
+    const CallTreeSpillStats& spill = tree.stats();
+    std::cout << "spilled nodes = " << spill.iNodes << " (" << spill.iSpills << " spills, " << spill.iBytes << " bytes)" << endl;
+    if (!tree.good())
+    {
+      std::cout << "cannot write spill file " << getTextOutputFile(options) << ".spill" << endl;
+    }
+
+    printSpilledTree(tree, options, filters, pStats);
+  }
+  else
+  {
+    /* Collect tree */
+    CallTree<TRecord> tree;
+    CallTreeSharingStats sharing;
+    stats = collectTree(tree, readTimed, prune, pRepairLog, options.bShareSubtrees ? &sharing : nullptr);
+    addIngestPhase("tree build", ingestTimer);
+    iNodes = tree.size();
+    if (options.bShareSubtrees)
+    {
+      std::cout << "shared subtrees = " << sharing.iShared << " (" << sharing.iReferences << " references, " << sharing.iNodesDropped << " nodes dropped)" << endl;
+    }
+
+    if (!options.sCacheOutFile.empty())
+    {
+      PhaseTimer cacheTimer;
+      if (!saveTraceCache(tree, options.sCacheOutFile))
+      {
+        std::cout << "cannot write trace cache " << options.sCacheOutFile << endl;
+      }
+      if (pStats != nullptr)
       {
-        std::cout << iDist << " : " << record.msResult_other << endl;
-        std::cout << record.msAddress << endl << record.msInstruction << endl << record.msResult << endl;
+        RunStats::Phase& phase = pStats->addPhase("cache save");
+        phase.fSeconds = cacheTimer.seconds();
+        phase.iItems = iNodes;
       }
+    }
+
+    /* Traverse and print */
+    printTree(tree, options, filters, pStats);
+  }
+
+  std::cout << "call stack repairs = " << stats.iRepairs << " (" << stats.iFramesDropped << " calls closed)" << endl;
+  std::cout << "unmatched returns = " << stats.iUnmatchedReturns << endl;
 
-      stack.erase(std::next(itCurrF), stack.end());
-      return;
+  if (pStats != nullptr)
+  {
+    pStats->iRecords = pParse->iItems;
+    pStats->iNodes = iNodes;
+    pStats->stack = stats;
+  }
+}
+
+// Only the calls of one function are read, the index points to their rows
+IdaCallStackStats focusTrace(std::string_view sTrace, const TraceFunctionIndex& index, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats)
+{
+  std::ofstream repairLogOutput;
+  IdaCallStackRepairLog repairLog;
+  IdaCallStackRepairLog* pRepairLog = nullptr;
+  if (!options.sRepairLogFile.empty())
+  {
+    repairLogOutput.open(options.sRepairLogFile);
+    repairLog.pOutput = &repairLogOutput;
+    repairLog.writeHeader();
+    pRepairLog = &repairLog;
+  }
+
+  PhaseTimer buildTimer;
+  const std::vector<TraceFunctionIndex::Range> ranges = index.ranges(options.sFocus);
+  std::cout << "focused calls = " << ranges.size() << endl;
+
+  // Every call becomes a child of the root
+  CallTree<IdaTraceRecordView> tree;
+  CallTreeAppender<IdaTraceRecordView> appender(tree);
+  const IdaTracePruneOptions prune = getPruneOptions(options, filters);
+  IdaTracePruner<CallTreeAppender<IdaTraceRecordView>> pruner(prune, appender);
+  IdaCallStackBuilder<IdaTraceRecordView> builder;
+  builder.setRepairLog(pRepairLog);
+  IdaCallStackStats stats;
+  uint64_t iRecords = 0;
+  uint64_t iBytes = 0;
+  for (const auto& range : ranges)
+  {
+    builder.reset();
+    std::string_view sInput = sTrace.substr(static_cast<size_t>(range.first), static_cast<size_t>(range.second - range.first));
+    iBytes += sInput.length();
+    IdaTraceRecordView record;
+    while (IdaTraceRecordView::readLine(sInput, record))
+    {
+      builder.append(record, pruner);
+      ++iRecords;
     }
+    stats += builder.stats();
+  }
+
+  if (pStats != nullptr)
+  {
+    RunStats::Phase& phase = pStats->addPhase("focus tree build");
+    phase.fSeconds = buildTimer.seconds();
+    phase.iItems = iRecords;
+    phase.iBytes = iBytes;
+    pStats->iRecords = iRecords;
+    pStats->iNodes = tree.size();
+    pStats->stack = stats;
   }
+
+  printTree(tree, options, filters, pStats);
+  return stats;
 }
 
-int main(int argc, const char* argv[])
+// Builds the trees of both traces and writes only the calls that differ.
+// The records point into the mappings of the traces. The repairs of both
+// builds go to one log, each line starts with the trace it was made in.
+IdaCallStackStats diffTraces(std::string_view sFirst, std::string_view sSecond, const CurrOpts& options, const IdaTraceFilters& filters, RunStats* pStats)
 {
-  struct CurrOpts
+  std::ofstream repairLogOutput;
+  IdaCallStackRepairLog repairLog;
+  IdaCallStackRepairLog* pRepairLog = nullptr;
+  const std::string sInputFiles[2] = { options.sInputFile, options.sDiffFile };
+  if (!options.sRepairLogFile.empty())
+  {
+    repairLogOutput.open(options.sRepairLogFile);
+    repairLog.pOutput = &repairLogOutput;
+    repairLog.sInput = sInputFiles[0];
+    repairLog.writeHeader();
+    pRepairLog = &repairLog;
+  }
+
+  const IdaTracePruneOptions prune = getPruneOptions(options, filters);
+  CallTree<IdaTraceRecordView> trees[2];
+  IdaCallStackStats stats;
+  PhaseTimer buildTimer;
+  uint64_t iRecords = 0;
+  const std::string_view sInputs[2] = { sFirst, sSecond };
+  for (int i = 0; i < 2; ++i)
+  {
+    if (pRepairLog != nullptr)
+    {
+      pRepairLog->sInput = sInputFiles[i];
+    }
+    const auto readCounted = [&iRecords](auto& reader, IdaTraceRecordView& record)
+    {
+      const bool bRead = reader.readLine(record);
+      iRecords += bRead ? 1 : 0;
+      return bRead;
+    };
+    if (options.iThreads != 1)
+    {
+      ParallelTraceReader reader(sInputs[i], static_cast<unsigned>(std::max(0, options.iThreads)));
+      stats += collectTree(trees[i], [&reader, &readCounted](IdaTraceRecordView& record) { return readCounted(reader, record); }, prune, pRepairLog);
+    }
+    else
+    {
+      TraceTokenReader reader(sInputs[i]);
+      stats += collectTree(trees[i], [&reader, &readCounted](IdaTraceRecordView& record) { return readCounted(reader, record); }, prune, pRepairLog);
+    }
+  }
+  if (pStats != nullptr)
+  {
+    RunStats::Phase& phase = pStats->addPhase("tree build");
+    phase.fSeconds = buildTimer.seconds();
+    phase.iItems = iRecords;
+    phase.iBytes = sFirst.length() + sSecond.length();
+    pStats->iRecords = iRecords;
+    pStats->iNodes = trees[0].size() + trees[1].size();
+    pStats->stack = stats;
+  }
+
+  PhaseTimer diffTimer;
+  std::unique_ptr<AsyncFileStream> pTextOutput;
+  OutputBuffer textBuffer;
+  IdaTreeDiffTextPrinter textPrinter;
+  if (options.sType == "all" || options.sType == "text")
+  {
+    pTextOutput.reset(new AsyncFileStream(getTextOutputFile(options)));
+    textBuffer.setTarget(pTextOutput->rdbuf());
+    textPrinter.pOutput = &textBuffer;
+  }
+  std::unique_ptr<AsyncFileStream> pDotOutput;
+  OutputBuffer dotBuffer;
+  IdaTreeDiffDotPrinter<IdaTraceRecordView> dotPrinter;
+  if (options.sType == "all" || options.sType == "dot")
   {
-    std::string sInputFile{};
-    std::string sOutputFile{};
-    std::string sFiltersFile{};
-    std::string sColumnsFile{};
-    std::string sType{ "all" };
+    pDotOutput.reset(new AsyncFileStream(getDotOutputFile(options)));
+    dotBuffer.setTarget(pDotOutput->rdbuf());
+    dotPrinter.pOutput = &dotBuffer;
+    dotPrinter.begin();
+  }
+
+  const auto printDiff = [&](CallTreeDiffKind kind, CallTreeNode<IdaTraceRecordView>& node, int iDepth, uint64_t iNodes)
+  {
+    if (pTextOutput)
+    {
+      textPrinter(kind, node, iDepth, iNodes);
+    }
+    if (pDotOutput)
+    {
+      dotPrinter(kind, node, iDepth, iNodes);
+    }
   };
+  CallTreeDiff<IdaTraceRecordView> diff(trees[0], trees[1]);
+  const CallTreeDiffStats diffStats = diff.run(printDiff);
+
+  if (pTextOutput)
+  {
+    textBuffer.flush();
+    pTextOutput->close();
+  }
+  if (pDotOutput)
+  {
+    dotPrinter.end();
+    dotBuffer.flush();
+    pDotOutput->close();
+  }
+  if (pStats != nullptr)
+  {
+    RunStats::Phase& phase = pStats->addPhase("diff");
+    phase.fSeconds = diffTimer.seconds();
+    phase.iItems = diffStats.iCommon + diffStats.iRemovedSubtrees + diffStats.iAddedSubtrees;
+    phase.iBytes = textBuffer.size() + dotBuffer.size();
+  }
+
+  std::cout << "removed subtrees = " << diffStats.iRemovedSubtrees << " (" << diffStats.iRemovedNodes << " nodes)" << endl;
+  std::cout << "added subtrees = " << diffStats.iAddedSubtrees << " (" << diffStats.iAddedNodes << " nodes)" << endl;
+  std::cout << "unchanged nodes = " << diffStats.iSameNodes << endl;
+  return stats;
+}
 
+int main(int argc, const char* argv[])
+{
   auto parser = CmdOpts<CurrOpts>::Create({
       {"--input", &CurrOpts::sInputFile },
       {"--output", &CurrOpts::sOutputFile },
       {"--filters", &CurrOpts::sFiltersFile },
       {"--columns", &CurrOpts::sColumnsFile },
       {"--type", &CurrOpts::sType },
+      {"--mmap", &CurrOpts::bMapInput },
+      {"--threads", &CurrOpts::iThreads },
+      {"--stream", &CurrOpts::bStream },
+      {"--output-text", &CurrOpts::sTextOutputFile },
+      {"--output-dot", &CurrOpts::sDotOutputFile },
+      {"--by-thread", &CurrOpts::sByThread },
+      {"--cache-out", &CurrOpts::sCacheOutFile },
+      {"--cache-in", &CurrOpts::sCacheInFile },
+      {"--repair-log", &CurrOpts::sRepairLogFile },
+      {"--top", &CurrOpts::iTop },
+      {"--stats", &CurrOpts::sStats },
+      {"--stats-file", &CurrOpts::sStatsFile },
+      {"--index", &CurrOpts::sIndexFile },
+      {"--focus", &CurrOpts::sFocus },
+      {"--max-depth", &CurrOpts::iMaxDepth },
+      {"--root", &CurrOpts::sRoot },
+      {"--follow", &CurrOpts::bFollow },
+      {"--follow-idle", &CurrOpts::fFollowIdle },
+      {"--dot-shard-depth", &CurrOpts::iDotShardDepth },
+      {"--dot-shard-nodes", &CurrOpts::iDotShardNodes },
+      {"--share-subtrees", &CurrOpts::bShareSubtrees },
+      {"--diff", &CurrOpts::sDiffFile },
+      {"--memory-limit", &CurrOpts::iMemoryLimit },
     });
 
   const auto options = parser->parse(argc, argv);
 
   std::cout << "input file = " << options.sInputFile << endl;
   std::cout << "output file = " << options.sOutputFile << endl;
+  if (options.sType == "all")
+  {
+    std::cout << "text output file = " << getTextOutputFile(options) << endl;
+    std::cout << "dot output file = " << getDotOutputFile(options) << endl;
+  }
   std::cout << "filters file = " << options.sFiltersFile << endl;
   std::cout << "requested type = " << options.sType << endl;
+  std::cout << "parser threads = " << options.iThreads << endl;
+
+  IdaTraceFilters filters;
+  filters.skipResult = IdaTraceFilters::loadFile(options.sFiltersFile);
+  filters.columns = IdaTraceFilters::loadFile(options.sColumnsFile);
+  filters.build();
 
-  std::vector<std::string> filterSkipResult;
-  std::ifstream fileFilters(options.sFiltersFile);
-  std::string sRow;
-  while (std::getline(fileFilters, sRow))
+  if ((options.bStream || options.bFollow) && options.sType != "text")
   {
-    if (!sRow.empty() && sRow.substr(0, 2) != "//")
-    {
-      filterSkipResult.push_back(sRow);
-    }
+    std::cout << "streaming is only supported for --type text" << endl;
+    return 1;
   }
-  fileFilters.close();
-
-  std::vector<std::string> filterColumns;
-  std::ifstream fileColumnsFilters(options.sColumnsFile);
-  std::string sRow1;
-  while (std::getline(fileColumnsFilters, sRow1))
+  if (options.bFollow && (!options.sByThread.empty() || !options.sCacheInFile.empty() || !options.sCacheOutFile.empty() || !options.sIndexFile.empty()))
   {
-    if (!sRow1.empty() && sRow1.substr(0, 2) != "//")
-    {
-      filterColumns.push_back(sRow1);
-    }
+    std::cout << "--follow streams the text tree, it cannot be combined with --by-thread, a trace cache or --index" << endl;
+    return 1;
+  }
+  if (!options.sByThread.empty() && ((options.sByThread != "merged" && options.sByThread != "files") || options.bStream))
+  {
+    std::cout << "--by-thread takes merged or files and cannot be streamed" << endl;
+    return 1;
+  }
+  if (!options.sCacheOutFile.empty() && (options.bStream || !options.sByThread.empty() || options.sType == "profile" || options.iMaxDepth > 0 || !options.sRoot.empty()))
+  {
+    std::cout << "--cache-out needs the whole call tree, it cannot be combined with --stream, --by-thread, --type profile, --max-depth or --root" << endl;
+    return 1;
+  }
+  if (options.bShareSubtrees && (options.bStream || options.bFollow || !options.sByThread.empty() || options.sType == "profile" || !options.sCacheOutFile.empty() || !options.sCacheInFile.empty() || !options.sIndexFile.empty()))
+  {
+    std::cout << "--share-subtrees is applied while the call tree is built, it cannot be combined with --stream, --follow, --by-thread, --type profile, a trace cache or --index" << endl;
+    return 1;
+  }
+  if (!options.sDiffFile.empty() && (options.bStream || options.bFollow || !options.sByThread.empty() || options.sType == "profile" || !options.sCacheOutFile.empty() || !options.sCacheInFile.empty() || !options.sIndexFile.empty() || options.bShareSubtrees || options.iDotShardDepth > 0 || options.iDotShardNodes > 0))
+  {
+    std::cout << "--diff compares two whole call trees, it cannot be combined with --stream, --follow, --by-thread, --type profile, a trace cache, --index, --share-subtrees or a sharded dot graph" << endl;
+    return 1;
+  }
+  if (options.sType == "json" && (!options.sByThread.empty() || !options.sCacheOutFile.empty() || !options.sIndexFile.empty() || options.bShareSubtrees || !options.sDiffFile.empty()))
+  {
+    std::cout << "--type json writes the calls while the trace is read, every thread on its own track; it cannot be combined with --by-thread, --cache-out, --index, --share-subtrees or --diff" << endl;
+    return 1;
+  }
+  if (options.iMemoryLimit < 0 || (options.iMemoryLimit > 0 && (options.sType != "text" || options.bStream || options.bFollow || !options.sByThread.empty() || !options.sCacheOutFile.empty() || !options.sCacheInFile.empty() || !options.sIndexFile.empty() || options.bShareSubtrees || !options.sDiffFile.empty())))
+  {
+    std::cout << "--memory-limit takes megabytes and only bounds the tree for --type text, it cannot be combined with --stream, --follow, --by-thread, a trace cache, --index, --share-subtrees or --diff" << endl;
+    return 1;
+  }
+  if ((options.iDotShardDepth > 0 || options.iDotShardNodes > 0) && options.sByThread == "merged")
+  {
+    std::cout << "a sharded dot graph is drawn per tree, use --by-thread files" << endl;
+    return 1;
+  }
+  if (!options.sStats.empty() && options.sStats != "text" && options.sStats != "json")
+  {
+    std::cout << "--stats takes text or json" << endl;
+    return 1;
   }
-  fileColumnsFilters.close();
-
-  std::ifstream fileInput(options.sInputFile);
 
-  /* Collect tree */
-  CallTree<IdaTraceFileRecord> tree;
-  tree.pRoot.reset(new CallTreeNode<IdaTraceFileRecord>());
+  if (!options.sFocus.empty() && (options.sIndexFile.empty() || options.bStream || !options.sByThread.empty() || !options.sCacheInFile.empty() || !options.sCacheOutFile.empty()))
+  {
+    std::cout << "--focus needs --index and cannot be combined with --stream, --by-thread or a trace cache" << endl;
+    return 1;
+  }
 
-  std::list<CallTreeNode<IdaTraceFileRecord>*> stack;
-  stack.push_back(tree.pRoot.get());
+  RunStats runStats;
+  RunStats* pStats = options.sStats.empty() ? nullptr : &runStats;
 
-  IdaTraceFileRecord recordPrev, recordCurr;
-  CallTreeNode<IdaTraceFileRecord>* pNodePrev, * pNodeCurr;
-  while (IdaTraceFileRecord::readLine(fileInput, recordCurr))
+  if (!options.sDiffFile.empty())
   {
-    if (recordPrev.msInstruction_name == "call" && recordCurr.msResult_func != recordPrev.msResult_func)
+    MappedFile firstInput(options.sInputFile);
+    MappedFile secondInput(options.sDiffFile);
+    if (!firstInput.isOpen() || !secondInput.isOpen())
     {
-      stack.push_back(pNodePrev);
+      std::cout << "cannot read input file " << (firstInput.isOpen() ? options.sDiffFile : options.sInputFile) << endl;
+      return 1;
     }
+    runStats.iInputBytes = firstInput.view().length() + secondInput.view().length();
 
-    pNodeCurr = stack.back()->appendNode(recordCurr);
+    const IdaCallStackStats stats = diffTraces(firstInput.view(), secondInput.view(), options, filters, pStats);
+    std::cout << "call stack repairs = " << stats.iRepairs << " (" << stats.iFramesDropped << " calls closed)" << endl;
+    std::cout << "unmatched returns = " << stats.iUnmatchedReturns << endl;
+  }
+  else if (!options.sIndexFile.empty())
+  {
+    MappedFile fileInput(options.sInputFile);
+    std::string_view sInput = fileInput.view();
+    runStats.iInputBytes = sInput.length();
 
-    if (recordCurr.msInstruction_name == "retn" || recordCurr.msInstruction_name == "bnd")
+    // An index is built once per trace and reused by the following runs
+    TraceFunctionIndex index;
+    PhaseTimer indexTimer;
+    if (!index.open(options.sIndexFile) || !index.isIndexOf(sInput))
     {
-      fixStack(stack, recordCurr);
-
-      if (stack.size() > 1)
-      {
-        stack.pop_back();
-      }
-      else
+      IdaCallStackStats stats;
+      if (!buildTraceFunctionIndex(sInput, options.sIndexFile, &stats) || !index.open(options.sIndexFile))
       {
-        pNodeCurr->appendNode(IdaTraceFileRecord("error", "error", "error", "error"));
+        std::cout << "cannot write function index " << options.sIndexFile << endl;
+        return 1;
       }
+      RunStats::Phase& phase = runStats.addPhase("index build");
+      phase.fSeconds = indexTimer.seconds();
+      phase.iItems = index.calls();
+      phase.iBytes = sInput.length();
+      runStats.stack = stats;
+      std::cout << "indexed functions = " << index.functions() << " (" << index.calls() << " calls)" << endl;
+    }
+    else
+    {
+      RunStats::Phase& phase = runStats.addPhase("index load");
+      phase.fSeconds = indexTimer.seconds();
+      phase.iItems = index.calls();
     }
 
-    pNodePrev = pNodeCurr;
-    recordPrev = recordCurr;
+    if (!options.sFocus.empty())
+    {
+      const IdaCallStackStats stats = focusTrace(sInput, index, options, filters, pStats);
+      std::cout << "call stack repairs = " << stats.iRepairs << " (" << stats.iFramesDropped << " calls closed)" << endl;
+      std::cout << "unmatched returns = " << stats.iUnmatchedReturns << endl;
+    }
   }
-  fileInput.close();
-
-  /* Traverse and print */
-  if (options.sType == "all" || options.sType == "text")
+  else if (!options.sCacheInFile.empty())
   {
-    std::ofstream fileOutput(options.sOutputFile);
-    IdaTreeTabbedPrinterContext context;
-    context.pOutput = &fileOutput;
-    context.iDepthPrev = 0;
-    context.filterSkipResult = filterSkipResult;
-    tree.traverse(&treeTabbedTextPrinter, context.iDepthPrev, &context);
-    fileOutput.close();
+    // The trace was parsed before, its records point into the cache mapping
+    TraceCache cache;
+    if (!cache.open(options.sCacheInFile))
+    {
+      std::cout << "cannot read trace cache " << options.sCacheInFile << endl;
+      return 1;
+    }
+
+    runStats.iInputBytes = cache.fileSize();
+
+    // Pruning needs the records in trace order, the stored tree is complete
+    if (options.bStream || !options.sByThread.empty() || options.sType == "profile" || options.sType == "json" || options.iMaxDepth > 0 || !options.sRoot.empty())
+    {
+      processTrace<IdaTraceRecordView>([&cache](IdaTraceRecordView& record) { return cache.readLine(record); }, options, filters, pStats);
+    }
+    else
+    {
+      PhaseTimer loadTimer;
+      CallTree<IdaTraceRecordView> tree;
+      cache.collectTree(tree);
+      RunStats::Phase& phase = runStats.addPhase("cache load");
+      phase.fSeconds = loadTimer.seconds();
+      phase.iItems = cache.size();
+      phase.iBytes = runStats.iInputBytes;
+      runStats.iRecords = cache.size();
+      runStats.iNodes = tree.size();
+
+      printTree(tree, options, filters, pStats);
+    }
   }
-  if (options.sType == "all" || options.sType == "dot")
+  else if (options.bFollow)
   {
-    std::ofstream fileOutput(options.sOutputFile);
-    IdaTreeDotPrinterContext context;
-    context.pOutput = &fileOutput;
-    context.iDepthPrev = 0;
-    context.sPrev = "Begin";
-    context.filterSkipResult = filterSkipResult;
-    context.filterColumns = filterColumns;
+    // The trace is still being written, the tree grows with it
+    TraceFollower follower;
+    if (!follower.open(options.sInputFile, options.fFollowIdle))
+    {
+      std::cout << "cannot read input file " << options.sInputFile << endl;
+      return 1;
+    }
 
-    treeDotTextPrinterHeader(&context);
-    tree.traverse(&treeDotTextPrinter, context.iDepthPrev, &context);
-    treeDotTextPrinterFooter(&context);
+    CurrOpts followOptions = options;
+    followOptions.bStream = true;
+    processTrace<IdaTraceRecordView>([&follower](IdaTraceRecordView& record) { return follower.readLine(record); }, followOptions, filters, pStats, &follower);
+    runStats.iInputBytes = follower.size();
+  }
+  else if (options.bMapInput || options.iThreads != 1)
+  {
+    // Records and tree nodes point into the mapping, so it outlives both
+    MappedFile fileInput(options.sInputFile);
+    std::string_view sInput = fileInput.view();
+    runStats.iInputBytes = sInput.length();
 
-    fileOutput.close();
+    if (options.iThreads != 1)
+    {
+      ParallelTraceReader reader(sInput, static_cast<unsigned>(std::max(0, options.iThreads)));
+      processTrace<IdaTraceRecordView>([&reader](IdaTraceRecordView& record) { return reader.readLine(record); }, options, filters, pStats);
+    }
+    else
+    {
+      TraceTokenReader reader(sInput);
+      processTrace<IdaTraceRecordView>([&reader](IdaTraceRecordView& record) { return reader.readLine(record); }, options, filters, pStats);
+    }
+  }
+  else
+  {
+    std::ifstream fileInput(options.sInputFile);
+    fileInput.seekg(0, std::ios::end);
+    runStats.iInputBytes = static_cast<uint64_t>(std::max<std::streamoff>(0, fileInput.tellg()));
+    fileInput.seekg(0, std::ios::beg);
+    processTrace<IdaTraceFileRecord>([&fileInput](IdaTraceFileRecord& record) { return IdaTraceFileRecord::readLine(fileInput, record); }, options, filters, pStats);
+    fileInput.close();
   }
 
+  if (pStats != nullptr)
+  {
+    std::ofstream statsFile;
+    if (!options.sStatsFile.empty())
+    {
+      statsFile.open(options.sStatsFile);
+    }
+    std::ostream& statsOutput = options.sStatsFile.empty() ? std::cout : statsFile;
+    if (options.sStats == "json")
+    {
+      runStats.writeJson(statsOutput);
+    }
+    else
+    {
+      runStats.writeText(statsOutput);
+    }
+  }
 
   // done
 }